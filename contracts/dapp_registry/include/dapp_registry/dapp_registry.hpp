@@ -7,6 +7,7 @@
 #include <eosiolib/time.hpp>
 
 #include <eosio.system/eosio.system.hpp>
+#include <eosio.system/tracked_singleton.hpp>
 #include <eosio.token/eosio.token.hpp>
 
 #include <set>
@@ -27,7 +28,7 @@ class [[eosio::contract]] dapp_registry : public contract {
       int64_t total_unpaid_users = 0;
       int64_t total_unpaid_transactions = 0;
    };
-   typedef eosio::singleton< "config"_n, configuration > configuration_singleton;
+   typedef eosio::tracked_singleton< "config"_n, configuration > configuration_singleton;
 
 
    struct [[eosio::table]] dapp_info {
@@ -42,7 +43,7 @@ class [[eosio::contract]] dapp_registry : public contract {
       uint64_t primary_key() const { return dapp_name.value; }
       uint64_t by_owner() const { return owner.value; }
    };
-   typedef eosio::multi_index< "dapps"_n, dapp_info,
+   typedef eosio::counted_multi_index< "dapps"_n, dapp_info,
       indexed_by<"owner"_n, const_mem_fun<dapp_info, uint64_t, &dapp_info::by_owner>  >
    > dapp_info_table;
 
@@ -54,7 +55,7 @@ class [[eosio::contract]] dapp_registry : public contract {
       uint64_t primary_key() const { return account.value; }
       uint64_t by_dapp() const { return dapp_name.value; }
    };
-   typedef eosio::multi_index< "dappaccounts"_n, dapp_accounts_info,
+   typedef eosio::counted_multi_index< "dappaccounts"_n, dapp_accounts_info,
       indexed_by<"dapp"_n, const_mem_fun<dapp_accounts_info, uint64_t, &dapp_accounts_info::by_dapp>  >
    > dapp_accounts_info_table;
 
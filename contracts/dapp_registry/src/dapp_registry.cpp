@@ -7,7 +7,7 @@ namespace eosio {
    : eosio::contract(s, code, ds),
      _config_singleton(get_self(), get_self().value)
    {
-      _config = _config_singleton.get_or_create(_self, configuration{
+      _config = _config_singleton.get_tracked_or_default(configuration{
          .reward_rate  = 1,
          .claim_period = eosio::days( 1 )
       });
@@ -15,7 +15,7 @@ namespace eosio {
 
    dapp_registry::~dapp_registry()
    {
-      _config_singleton.set( _config, get_self() );
+      _config_singleton.set_if_changed( _config, get_self() );
    }
 
 
@@ -187,11 +187,12 @@ namespace eosio {
       {
          switch (action)
          {
-            EOSIO_DISPATCH_HELPER( dapp_registry, (add)(remove)(linkacc)(unlinkacc)(ontransfer)(claim)(setrewrate)(setclaimprd) )
+            EOSIO_DISPATCH_STATS_HELPER( dapp_registry, (add)(remove)(linkacc)(unlinkacc)(ontransfer)(claim)(setrewrate)(setclaimprd) )
          }
       }
       else if (code == token_account.value && action == "transfer"_n.value) {
          execute_action( name(receiver), name(code), &dapp_registry::transfer );
+         EOSIO_ACTION_STATS_FLUSH( receiver, action );
       }
    }
    }
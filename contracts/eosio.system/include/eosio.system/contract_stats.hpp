@@ -0,0 +1,278 @@
+#pragma once
+
+#include <eosiolib/action.hpp>
+#include <eosiolib/dispatcher.hpp>
+#include <eosiolib/multi_index.hpp>
+#include <eosiolib/system.h>
+
+/**
+ *  Optional instrumentation of contract actions, enabled by building with CONTRACT_STATS=ON which
+ *  defines EOSIO_CONTRACT_STATS. When enabled, table reads and writes done through counted_multi_index,
+ *  inline actions sent by INLINE_ACTION_SENDER and bytes of global state written through tracked_singleton
+ *  are counted per action and accumulated in the actionstats table of the contract. When disabled,
+ *  counted_multi_index is eosio::multi_index and nothing else is compiled in.
+ */
+namespace eosio {
+
+#ifdef EOSIO_CONTRACT_STATS
+
+   static constexpr uint64_t stats_window_us    = 3600ull * 1000000; /// length of a stats window, one hour
+   static constexpr uint64_t stats_window_count = 24;                /// windows kept, one scope of actionstats each
+
+   struct action_counters {
+      uint64_t reads = 0;
+      uint64_t modifies = 0;
+      uint64_t emplaces = 0;
+      uint64_t erases = 0;
+      uint64_t inline_actions = 0;
+      uint64_t state_bytes = 0;
+   };
+
+   inline action_counters& current_action_counters() {
+      static action_counters counters;
+      return counters;
+   }
+
+   inline void count_inline_action() {
+      ++current_action_counters().inline_actions;
+   }
+
+   inline void count_state_bytes( size_t bytes ) {
+      current_action_counters().state_bytes += bytes;
+   }
+
+   /**
+    *  Counters of one action accumulated over one stats window. The table is scoped by
+    *  window % stats_window_count, a row is reset when its scope is reused by a newer window.
+    */
+   struct [[eosio::table("actionstats")]] action_stats {
+      name              action;
+      uint64_t          window = 0;
+      uint64_t          calls = 0;
+      uint64_t          reads = 0;
+      uint64_t          modifies = 0;
+      uint64_t          emplaces = 0;
+      uint64_t          erases = 0;
+      uint64_t          inline_actions = 0;
+      uint64_t          state_bytes = 0; /// bytes written to tracked singletons, the global state blocks
+
+      uint64_t primary_key()const { return action.value; }
+
+      EOSLIB_SERIALIZE( action_stats, (action)(window)(calls)(reads)(modifies)(emplaces)(erases)(inline_actions)(state_bytes) )
+   };
+
+   typedef multi_index< "actionstats"_n, action_stats > action_stats_table;
+
+   /**
+    *  Adds the counters of the current action to the actionstats table of contract.
+    */
+   inline void flush_action_stats( name contract, name action ) {
+      const auto& counters = current_action_counters();
+      const uint64_t window = current_time() / stats_window_us;
+
+      action_stats_table stats( contract, window % stats_window_count );
+      auto add = [&]( action_stats& s ) {
+         if( s.window != window ) {
+            s = action_stats{};
+            s.action = action;
+            s.window = window;
+         }
+         s.calls++;
+         s.reads          += counters.reads;
+         s.modifies       += counters.modifies;
+         s.emplaces       += counters.emplaces;
+         s.erases         += counters.erases;
+         s.inline_actions += counters.inline_actions;
+         s.state_bytes    += counters.state_bytes;
+      };
+
+      auto itr = stats.find( action.value );
+      if( itr == stats.end() ) {
+         stats.emplace( contract, add );
+      } else {
+         stats.modify( itr, same_payer, add );
+      }
+   }
+
+   /**
+    *  Secondary index of a counted_multi_index, counts lookups and row writes like the table.
+    */
+   template<typename Index>
+   class counted_index {
+      public:
+         using const_iterator         = typename Index::const_iterator;
+         using const_reverse_iterator = typename Index::const_reverse_iterator;
+
+         explicit counted_index( Index index ) :_index( std::move(index) ) {}
+
+         const_iterator cbegin()const { return _index.cbegin(); }
+         const_iterator begin()const  { return _index.begin(); }
+         const_iterator cend()const   { return _index.cend(); }
+         const_iterator end()const    { return _index.end(); }
+
+         const_reverse_iterator crbegin()const { return _index.crbegin(); }
+         const_reverse_iterator rbegin()const  { return _index.rbegin(); }
+         const_reverse_iterator crend()const   { return _index.crend(); }
+         const_reverse_iterator rend()const    { return _index.rend(); }
+
+         template<typename Key>
+         const_iterator find( Key&& key )const {
+            ++current_action_counters().reads;
+            return _index.find( std::forward<Key>(key) );
+         }
+
+         template<typename Key>
+         const_iterator lower_bound( Key&& key )const {
+            ++current_action_counters().reads;
+            return _index.lower_bound( std::forward<Key>(key) );
+         }
+
+         template<typename Key>
+         const_iterator upper_bound( Key&& key )const {
+            ++current_action_counters().reads;
+            return _index.upper_bound( std::forward<Key>(key) );
+         }
+
+         template<typename Key>
+         const auto& get( Key&& key, const char* error_msg = "unable to find secondary key" )const {
+            ++current_action_counters().reads;
+            return _index.get( std::forward<Key>(key), error_msg );
+         }
+
+         template<typename T>
+         const_iterator iterator_to( const T& obj )const {
+            return _index.iterator_to( obj );
+         }
+
+         template<typename Lambda>
+         void modify( const_iterator itr, name payer, Lambda&& updater ) {
+            ++current_action_counters().modifies;
+            _index.modify( itr, payer, std::forward<Lambda>(updater) );
+         }
+
+         const_iterator erase( const_iterator itr ) {
+            ++current_action_counters().erases;
+            return _index.erase( itr );
+         }
+
+      private:
+         Index _index;
+   };
+
+   /**
+    *  multi_index that counts key lookups and row writes of the current action, through the
+    *  table and through its secondary indices.
+    */
+   template<name::raw TableName, typename T, typename... Indices>
+   class counted_multi_index : public multi_index<TableName, T, Indices...> {
+      using base = multi_index<TableName, T, Indices...>;
+
+      public:
+         using typename base::const_iterator;
+         using base::base;
+
+         const_iterator find( uint64_t primary )const {
+            ++current_action_counters().reads;
+            return base::find( primary );
+         }
+
+         const T& get( uint64_t primary, const char* error_msg = "unable to find key" )const {
+            ++current_action_counters().reads;
+            return base::get( primary, error_msg );
+         }
+
+         template<typename Lambda>
+         const_iterator emplace( name payer, Lambda&& constructor ) {
+            ++current_action_counters().emplaces;
+            return base::emplace( payer, std::forward<Lambda>(constructor) );
+         }
+
+         template<typename Lambda>
+         void modify( const_iterator itr, name payer, Lambda&& updater ) {
+            ++current_action_counters().modifies;
+            base::modify( itr, payer, std::forward<Lambda>(updater) );
+         }
+
+         template<typename Lambda>
+         void modify( const T& obj, name payer, Lambda&& updater ) {
+            ++current_action_counters().modifies;
+            base::modify( obj, payer, std::forward<Lambda>(updater) );
+         }
+
+         const_iterator erase( const_iterator itr ) {
+            ++current_action_counters().erases;
+            return base::erase( itr );
+         }
+
+         void erase( const T& obj ) {
+            ++current_action_counters().erases;
+            base::erase( obj );
+         }
+
+         template<name::raw IndexName>
+         auto get_index() {
+            using index_type = std::decay_t<decltype( base::template get_index<IndexName>() )>;
+            return counted_index<index_type>( base::template get_index<IndexName>() );
+         }
+
+         template<name::raw IndexName>
+         auto get_index()const {
+            using index_type = std::decay_t<decltype( base::template get_index<IndexName>() )>;
+            return counted_index<index_type>( base::template get_index<IndexName>() );
+         }
+   };
+
+#else
+
+   inline void count_state_bytes( size_t ) {}
+
+   template<name::raw TableName, typename T, typename... Indices>
+   using counted_multi_index = multi_index<TableName, T, Indices...>;
+
+#endif
+
+} /// namespace eosio
+
+#ifdef EOSIO_CONTRACT_STATS
+
+#undef INLINE_ACTION_SENDER3
+#define INLINE_ACTION_SENDER3( CONTRACT_CLASS, FUNCTION_NAME, ACTION_NAME  )\
+( ::eosio::count_inline_action(), &::eosio::inline_dispatcher<decltype(&CONTRACT_CLASS::FUNCTION_NAME), ACTION_NAME>::call )
+
+#define EOSIO_ACTION_STATS_FLUSH( RECEIVER, ACTION ) \
+::eosio::flush_action_stats( ::eosio::name(RECEIVER), ::eosio::name(ACTION) )
+
+#else
+
+#define EOSIO_ACTION_STATS_FLUSH( RECEIVER, ACTION )
+
+#endif
+
+#define EOSIO_DISPATCH_STATS_INTERNAL( r, OP, elem ) \
+   case eosio::name( BOOST_PP_STRINGIZE(elem) ).value: \
+      eosio::execute_action( eosio::name(receiver), eosio::name(code), &OP::elem ); \
+      EOSIO_ACTION_STATS_FLUSH( receiver, action ); \
+      break;
+
+/**
+ *  Same as EOSIO_DISPATCH_HELPER, in addition flushes the counters of the dispatched action when
+ *  EOSIO_CONTRACT_STATS is defined. Unknown actions are not dispatched and leave no stats.
+ */
+#define EOSIO_DISPATCH_STATS_HELPER( TYPE, MEMBERS ) \
+   BOOST_PP_SEQ_FOR_EACH( EOSIO_DISPATCH_STATS_INTERNAL, TYPE, MEMBERS )
+
+/**
+ *  Same as EOSIO_DISPATCH, in addition flushes the counters of the dispatched action when
+ *  EOSIO_CONTRACT_STATS is defined.
+ */
+#define EOSIO_DISPATCH_WITH_STATS( TYPE, MEMBERS ) \
+extern "C" { \
+   [[eosio::wasm_entry]] \
+   void apply( uint64_t receiver, uint64_t code, uint64_t action ) { \
+      if( code == receiver ) { \
+         switch( action ) { \
+            EOSIO_DISPATCH_STATS_HELPER( TYPE, MEMBERS ) \
+         } \
+      } \
+   } \
+}
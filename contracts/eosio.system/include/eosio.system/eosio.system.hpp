@@ -2,16 +2,21 @@
 
 #include <eosio.system/native.hpp>
 #include <eosiolib/asset.hpp>
+#include <eosiolib/binary_extension.hpp>
 #include <eosiolib/time.hpp>
 #include <eosiolib/privileged.hpp>
 #include <eosiolib/singleton.hpp>
+#include <eosio.system/contract_stats.hpp>
 #include <eosio.system/exchange_state.hpp>
+#include <eosio.system/tracked_singleton.hpp>
 
 #include <string>
 #include <deque>
 #include <type_traits>
 #include <optional>
 
+#include <boost/container/flat_map.hpp>
+
 #ifdef CHANNEL_RAM_AND_NAMEBID_FEES_TO_REX
 #undef CHANNEL_RAM_AND_NAMEBID_FEES_TO_REX
 #endif
@@ -71,15 +76,20 @@ namespace eosiosystem {
       uint64_t primary_key()const { return bidder.value; }
    };
 
-   typedef eosio::multi_index< "namebids"_n, name_bid,
+   typedef eosio::counted_multi_index< "namebids"_n, name_bid,
                                indexed_by<"highbid"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_high_bid>  >
                              > name_bid_table;
 
-   typedef eosio::multi_index< "bidrefunds"_n, bid_refund > bid_refund_table;
+   typedef eosio::counted_multi_index< "bidrefunds"_n, bid_refund > bid_refund_table;
 
+   /**
+    * Chain parameters and rarely changing global state. The ram, bucket and vote counters
+    * are kept here only for serialization compatibility: since migrateglob they are read
+    * and written in eosio_global_counters and their copies here keep the values of the
+    * migration. Readers of the global table, e.g. total_producer_vote_weight of
+    * get_producers, have to read globalcounts instead.
+    */
    struct [[eosio::table("global"), eosio::contract("eosio.system")]] eosio_global_state : eosio::blockchain_parameters {
-      uint64_t free_ram()const { return max_ram_size - total_ram_bytes_reserved; }
-
       uint64_t             max_ram_size = 64ll*1024 * 1024 * 1024;
       uint64_t             total_ram_bytes_reserved = 0;
       int64_t              total_ram_stake = 0;
@@ -114,6 +124,40 @@ namespace eosiosystem {
                                 (last_producer_schedule_size)(total_producer_vote_weight)(last_name_close)(max_vote_power)(vote_claim_period) )
    };
 
+   /**
+    * Global counters changed by frequent actions, split from eosio_global_state so that these
+    * actions do not serialize the chain parameters.
+    */
+   struct [[eosio::table("globalcounts"), eosio::contract("eosio.system")]] eosio_global_counters {
+      eosio_global_counters(){}
+
+      uint64_t             total_ram_bytes_reserved = 0;
+      int64_t              total_ram_stake = 0;
+
+      block_timestamp      last_producer_schedule_update;
+      time_point           last_pervote_bucket_fill;
+      time_point           last_dapp_bucket_fill;
+      int64_t              perblock_bucket = 0;
+      int64_t              pervote_bucket = 0;
+      int64_t              perwitness_bucket = 0;
+      int64_t              dapps_per_transfer_rewards_bucket = 0;
+      int64_t              dapps_per_user_rewards_bucket = 0;
+      uint32_t             total_unpaid_blocks = 0; /// all blocks which have been produced but not paid
+      int64_t              total_unpaid_votes = 0; /// all votes that users made but not paid
+      uint32_t             oracle_bucket = 0;
+      int64_t              total_activated_stake = 0;
+      double               total_producer_vote_weight = 0; /// the sum of all producer votes
+      block_timestamp      last_name_close;
+      uint64_t             proposed_schedules = 0; /// schedules accepted by set_proposed_producers
+      uint64_t             skipped_schedules = 0;  /// schedule updates skipped because the schedule did not change
+
+      EOSLIB_SERIALIZE( eosio_global_counters, (total_ram_bytes_reserved)(total_ram_stake)
+                        (last_producer_schedule_update)(last_pervote_bucket_fill)(last_dapp_bucket_fill)
+                        (perblock_bucket)(pervote_bucket)(perwitness_bucket)(dapps_per_transfer_rewards_bucket)(dapps_per_user_rewards_bucket)
+                        (total_unpaid_blocks)(total_unpaid_votes)(oracle_bucket)(total_activated_stake)
+                        (total_producer_vote_weight)(last_name_close)(proposed_schedules)(skipped_schedules) )
+   };
+
    // Setting a constant value structure
    // struct [[eosio::table("global"), eosio::contract("eosio.system")]] eosio_global_state : eosio::blockchain_parameters {
    //    uint64_t free_ram()const { return max_ram_size - total_ram_bytes_reserved; }
@@ -230,6 +274,24 @@ namespace eosiosystem {
       EOSLIB_SERIALIZE( producer_info3, (owner)(witnesspay_share)(last_witnesspay_share_update) )
    };
 
+   /**
+    * Vote pay and witness pay state of a producer, replaces the producers2 and producers3 rows.
+    * Rows are migrated lazily from producers2/producers3 the first time a producer is touched.
+    */
+   struct [[eosio::table, eosio::contract("eosio.system")]] producer_pay_info {
+      name            owner;
+      double          votepay_share = 0;
+      time_point      last_votepay_share_update;
+      double          witnesspay_share = 0;
+      time_point      last_witnesspay_share_update;
+
+      uint64_t primary_key()const { return owner.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( producer_pay_info, (owner)(votepay_share)(last_votepay_share_update)
+                        (witnesspay_share)(last_witnesspay_share_update) )
+   };
+
    struct [[eosio::table, eosio::contract("eosio.system")]] voter_info {
       name                owner;     /// the voter
       name                proxy;     /// the proxy set by the voter, if any
@@ -270,21 +332,230 @@ namespace eosiosystem {
                                     (proxied_vote_weight)(is_proxy)(flags1)(reserved2)(reserved3) )
    };
 
-   typedef eosio::multi_index< "voters"_n, voter_info >  voters_table;
+   typedef eosio::counted_multi_index< "voters"_n, voter_info >  voters_table;
+
+   static constexpr uint64_t     reward_index_precision = 1'000'000'000'000'000ull; /// scale of voter_reward_state::reward_per_power
+
+   /**
+    * Cumulative voter reward paid per unit of vote power. Voter rewards of a settlement are not added
+    * at once but released over the following settlement period, so voters earn in proportion to vote
+    * power multiplied by the time they keep it instead of for the power they hold at settlement.
+    */
+   struct [[eosio::table("voterreward"), eosio::contract("eosio.system")]] voter_reward_state {
+      voter_reward_state() { }
+      uint128_t         reward_per_power = 0;
+      int64_t           total_vote_power = 0;  /// sum of voter_pay_info::vote_power
+      int64_t           undistributed = 0;     /// rewards released while no vote power was registered, streamed again by the next settlement
+      int64_t           streaming = 0;         /// settled rewards not released to reward_per_power yet
+      time_point        last_update;           /// time reward_per_power was advanced to
+      time_point        stream_end;            /// time by which streaming is released completely
+      name              backfill_cursor;       /// next voter registered by backfillvpay
+      bool              backfill_done = false;
+
+      /// releases the part of streaming that falls between last_update and now, evenly over time until stream_end
+      void advance( time_point now ) {
+         const time_point until = std::min( now, stream_end );
+         if( streaming > 0 && until > last_update ) {
+            const int64_t released = int64_t( (uint128_t(streaming) * uint64_t((until - last_update).count()))
+                                              / uint64_t((stream_end - last_update).count()) );
+            streaming -= released;
+            if( total_vote_power > 0 ) {
+               reward_per_power += (uint128_t(released) * reward_index_precision) / uint64_t(total_vote_power);
+            } else {
+               undistributed += released;
+            }
+         }
+         if( now > last_update ) {
+            last_update = now;
+         }
+      }
+
+      EOSLIB_SERIALIZE( voter_reward_state, (reward_per_power)(total_vote_power)(undistributed)(streaming)
+                                            (last_update)(stream_end)(backfill_cursor)(backfill_done) )
+   };
+
+   typedef eosio::singleton< "voterreward"_n, voter_reward_state > voter_reward_singleton;
 
+   /**
+    * Vote power of a voter and the reward index it was last accrued at.
+    */
+   struct [[eosio::table("voterpay"), eosio::contract("eosio.system")]] voter_pay_info {
+      name              owner;
+      int64_t           vote_power = 0;
+      uint128_t         reward_per_power = 0;
+      int64_t           unpaid_rewards = 0;
+
+      uint64_t primary_key()const { return owner.value; }
 
-   typedef eosio::multi_index< "producers"_n, producer_info,
+      /// rewards earned since the last accrual when the index has grown to current_reward_per_power
+      int64_t accrued( uint128_t current_reward_per_power )const {
+         return int64_t( (uint128_t(vote_power) * (current_reward_per_power - reward_per_power)) / reward_index_precision );
+      }
+
+      EOSLIB_SERIALIZE( voter_pay_info, (owner)(vote_power)(reward_per_power)(unpaid_rewards) )
+   };
+
+   typedef eosio::counted_multi_index< "voterpay"_n, voter_pay_info >  voters_pay_table;
+
+   /**
+    * Vote weight change accumulated per producer during one action, the flag marks
+    * producers that belong to the new vote of the voter.
+    */
+   typedef boost::container::flat_map< name, std::pair<double, bool> > producer_deltas_map;
+
+   /**
+    * Voter reward index of one action, read and advanced by the first vote power change and
+    * written once by apply_voter_rewards. Unset while no vote power changed.
+    */
+   typedef std::optional< voter_reward_state > voter_rewards_batch;
+
+
+   typedef eosio::counted_multi_index< "producers"_n, producer_info,
                                indexed_by<"prototalvote"_n, const_mem_fun<producer_info, double, &producer_info::by_votes>  >
                              > producers_table;
-   typedef eosio::multi_index< "producers2"_n, producer_info2 > producers_table2;
-   typedef eosio::multi_index< "producers3"_n, producer_info3 > producers_table3;
+   typedef eosio::counted_multi_index< "producers2"_n, producer_info2 > producers_table2;
+   typedef eosio::counted_multi_index< "producers3"_n, producer_info3 > producers_table3;
+   typedef eosio::counted_multi_index< "producerpay"_n, producer_pay_info > producers_pay_table;
+
+   typedef eosio::tracked_singleton< "global"_n, eosio_global_state >   global_state_singleton;
+   typedef eosio::tracked_singleton< "global2"_n, eosio_global_state2 > global_state2_singleton;
+   typedef eosio::tracked_singleton< "global3"_n, eosio_global_state3 > global_state3_singleton;
+   typedef eosio::tracked_singleton< "global4"_n, eosio_global_state4 > global_state4_singleton;
+   typedef eosio::tracked_singleton< "globalcounts"_n, eosio_global_counters > global_counters_singleton;
+
+   /**
+    * Producers that currently accrue witnesspay share, sorted by name.
+    * Refreshed by update_witnesses after every change of producer votes or of
+    * producer_info::active(): voteproducer, votebatch, update_votes, regproxy, regproducer,
+    * unregprod, rmvproducer and the producer deactivation of undelegatebw. A new path that
+    * changes either has to call it too, so that the set from before a change is read
+    * instead of being rebuilt from the prototalvote index.
+    */
+   struct [[eosio::table("witnesses"), eosio::contract("eosio.system")]] witness_state {
+      witness_state() { }
+      std::vector<name> witnesses;
+
+      EOSLIB_SERIALIZE( witness_state, (witnesses) )
+   };
+
+   typedef eosio::singleton< "witnesses"_n, witness_state > witness_state_singleton;
+
+   /**
+    * Fingerprint of the last producer schedule accepted by set_proposed_producers, used by
+    * update_elected_producers to skip proposing an unchanged schedule.
+    */
+   struct [[eosio::table("schedule"), eosio::contract("eosio.system")]] producer_schedule_state {
+      producer_schedule_state() { }
+      capi_checksum256  last_proposed_hash{};
+
+      EOSLIB_SERIALIZE( producer_schedule_state, (last_proposed_hash) )
+   };
 
-   typedef eosio::singleton< "global"_n, eosio_global_state >   global_state_singleton;
-   typedef eosio::singleton< "global2"_n, eosio_global_state2 > global_state2_singleton;
-   typedef eosio::singleton< "global3"_n, eosio_global_state3 > global_state3_singleton;
-   typedef eosio::singleton< "global4"_n, eosio_global_state4 > global_state4_singleton;
+   typedef eosio::singleton< "schedule"_n, producer_schedule_state > producer_schedule_singleton;
+
+   /**
+    * Inflation accrued by share_inflation that has not been issued yet. It is issued and
+    * distributed to the reward buckets once per settlement_period or by settleinfl.
+    */
+   struct [[eosio::table("inflation"), eosio::contract("eosio.system")]] inflation_state {
+      inflation_state() { }
+      int64_t           pending_tokens = 0;
+      time_point        last_settlement;
+      microseconds      settlement_period = eosio::days( 1 );
+      int64_t           core_supply = 0; ///< core token supply as of the last settlement, exact only right after it: retire and issues of other accounts in between are picked up by the next settlement
+
+      EOSLIB_SERIALIZE( inflation_state, (pending_tokens)(last_settlement)(settlement_period)(core_supply) )
+   };
+
+   typedef eosio::singleton< "inflation"_n, inflation_state > inflation_state_singleton;
+
+   static constexpr uint16_t     rate_basis_points = 10000;     /// 100% expressed in basis points
+
+   /**
+    * Split of settled inflation between funds and reward buckets, in basis points. Each group of
+    * rates sums up to rate_basis_points, the defaults are the rates the network launched with.
+    */
+   struct [[eosio::table("rewardrates"), eosio::contract("eosio.system")]] reward_rates {
+      // of new tokens
+      uint16_t          network = 5000;
+      uint16_t          infrastructure = 5000;
+      // of network rewards
+      uint16_t          producers = 6000;
+      uint16_t          dapps = 2000;
+      uint16_t          witnesses = 1500;
+      uint16_t          voters = 500;
+      // of infrastructure rewards
+      uint16_t          community = 6500;
+      uint16_t          marketing = 1000;
+      uint16_t          founding = 2500;
+      // of community rewards
+      uint16_t          oracle = 200;
+
+      EOSLIB_SERIALIZE( reward_rates, (network)(infrastructure)(producers)(dapps)(witnesses)(voters)
+                                      (community)(marketing)(founding)(oracle) )
+   };
+
+   typedef eosio::singleton< "rewardrates"_n, reward_rates > reward_rates_singleton;
+
+   struct producer_block_count {
+      name              producer;
+      uint32_t          blocks = 0;
+
+      EOSLIB_SERIALIZE( producer_block_count, (producer)(blocks) )
+   };
+
+   /**
+    * Blocks produced since the last flush. A producer signs a run of consecutive blocks, so onblock
+    * only remembers the first block number of the current run and writes the state when the
+    * producer changes, the run length is then added to the counter of its producer. The counts are
+    * moved into producer_info::unpaid_blocks and total_unpaid_blocks once per schedule update and
+    * before each claimrewards.
+    */
+   struct [[eosio::table("unpaidblocks"), eosio::contract("eosio.system")]] unpaid_blocks_state {
+      unpaid_blocks_state() { }
+      std::vector<producer_block_count> producers;  /// blocks of finished runs
+      name              current_producer;           /// producer of the current run
+      uint32_t          current_first_block = 0;    /// first block of the current run not added to producers yet
+
+      /// adds blocks of the current run before next_block to its producer
+      void count_current_run( uint32_t next_block ) {
+         if( !current_producer || next_block <= current_first_block ) {
+            return;
+         }
+         const uint32_t blocks = next_block - current_first_block;
+         current_first_block = next_block;
+         for( auto& c : producers ) {
+            if( c.producer == current_producer ) {
+               c.blocks += blocks;
+               return;
+            }
+         }
+         producers.push_back( producer_block_count{ current_producer, blocks } );
+      }
+
+      EOSLIB_SERIALIZE( unpaid_blocks_state, (producers)(current_producer)(current_first_block) )
+   };
+
+   typedef eosio::singleton< "unpaidblocks"_n, unpaid_blocks_state > unpaid_blocks_singleton;
+
+   /**
+    * Housekeeping scheduled by onblock once per producer schedule update. Each task processes up
+    * to rows_per_run loans, orders or other rows per run.
+    */
+   struct [[eosio::table("maintenance"), eosio::contract("eosio.system")]] maintenance_state {
+      maintenance_state() { }
+      uint16_t          rows_per_run = 30;
+
+      EOSLIB_SERIALIZE( maintenance_state, (rows_per_run) )
+   };
+
+   typedef eosio::singleton< "maintenance"_n, maintenance_state > maintenance_singleton;
 
    static constexpr uint32_t     seconds_per_day = 24 * 3600;
+   static constexpr uint32_t     max_witness_count = 50;        /// top producers eligible for witness pay
+   static constexpr double       min_witness_vote_share = 0.005; /// share of total producer vote weight required to be a witness
+   static constexpr uint32_t     max_proxy_depth = 2;           /// proxies cannot use a proxy, so one hop is the deepest valid chain
+   static constexpr uint32_t     max_producer_deltas = 60;      /// producers touched by one vote change: previous and new vote of 30 each
 
    struct [[eosio::table,eosio::contract("eosio.system")]] rex_pool {
       uint8_t    version = 0;
@@ -299,7 +570,7 @@ namespace eosiosystem {
       uint64_t primary_key()const { return 0; }
    };
 
-   typedef eosio::multi_index< "rexpool"_n, rex_pool > rex_pool_table;
+   typedef eosio::counted_multi_index< "rexpool"_n, rex_pool > rex_pool_table;
 
    struct [[eosio::table,eosio::contract("eosio.system")]] rex_fund {
       uint8_t version = 0;
@@ -309,7 +580,7 @@ namespace eosiosystem {
       uint64_t primary_key()const { return owner.value; }
    };
 
-   typedef eosio::multi_index< "rexfund"_n, rex_fund > rex_fund_table;
+   typedef eosio::counted_multi_index< "rexfund"_n, rex_fund > rex_fund_table;
 
    struct [[eosio::table,eosio::contract("eosio.system")]] rex_balance {
       uint8_t version = 0;
@@ -322,7 +593,7 @@ namespace eosiosystem {
       uint64_t primary_key()const { return owner.value; }
    };
 
-   typedef eosio::multi_index< "rexbal"_n, rex_balance > rex_balance_table;
+   typedef eosio::counted_multi_index< "rexbal"_n, rex_balance > rex_balance_table;
 
    struct [[eosio::table,eosio::contract("eosio.system")]] rex_loan {
       uint8_t             version = 0;
@@ -339,12 +610,12 @@ namespace eosiosystem {
       uint64_t by_owner()const    { return from.value;                 }
    };
 
-   typedef eosio::multi_index< "cpuloan"_n, rex_loan,
+   typedef eosio::counted_multi_index< "cpuloan"_n, rex_loan,
                                indexed_by<"byexpr"_n,  const_mem_fun<rex_loan, uint64_t, &rex_loan::by_expr>>,
                                indexed_by<"byowner"_n, const_mem_fun<rex_loan, uint64_t, &rex_loan::by_owner>>
                              > rex_cpu_loan_table;
 
-   typedef eosio::multi_index< "netloan"_n, rex_loan,
+   typedef eosio::counted_multi_index< "netloan"_n, rex_loan,
                                indexed_by<"byexpr"_n,  const_mem_fun<rex_loan, uint64_t, &rex_loan::by_expr>>,
                                indexed_by<"byowner"_n, const_mem_fun<rex_loan, uint64_t, &rex_loan::by_owner>>
                              > rex_net_loan_table;
@@ -363,7 +634,7 @@ namespace eosiosystem {
       uint64_t by_time()const     { return is_open ? order_time.elapsed.count() : std::numeric_limits<uint64_t>::max(); }
    };
 
-   typedef eosio::multi_index< "rexqueue"_n, rex_order,
+   typedef eosio::counted_multi_index< "rexqueue"_n, rex_order,
                                indexed_by<"bytime"_n, const_mem_fun<rex_order, uint64_t, &rex_order::by_time>>> rex_order_table;
 
    struct rex_order_outcome {
@@ -392,7 +663,7 @@ namespace eosiosystem {
          return oracle_account.value != 0;
       }
    };
-   typedef eosio::multi_index< "oracles"_n, oracle_info,
+   typedef eosio::counted_multi_index< "oracles"_n, oracle_info,
       indexed_by<"oracleacc"_n, const_mem_fun<oracle_info, uint64_t, &oracle_info::by_oracle_account>  >
    > oracle_info_table;
 
@@ -415,39 +686,162 @@ namespace eosiosystem {
       uint16_t         aggregation_type;
       uint16_t         prefered_api;
       std::string      string_to_count;
+      eosio::binary_extension<std::vector<uint64_t>> api_ids; /// api templates used after apis
+
+      uint64_t  primary_key() const { return id; }
+      uint128_t by_time() const { return (uint128_t( time.time_since_epoch().count() ) << 64) | id; }
+   };
+   typedef eosio::counted_multi_index< "requests"_n, request_info,
+      indexed_by<"bytime"_n, const_mem_fun<request_info, uint128_t, &request_info::by_time> >
+   > request_info_table;
+
+   /**
+    * Caller with open requests, so that timed out requests can be found without knowing the scopes
+    * of all callers. The row is added by the first request of the caller and erased by the sweep
+    * that finds no request of the caller left.
+    */
+   struct [[eosio::table, eosio::contract("eosio.system")]] request_caller {
+      name caller;
+
+      uint64_t primary_key() const { return caller.value; }
+   };
+   typedef eosio::counted_multi_index< "reqcallers"_n, request_caller > request_caller_table;
+
+   /**
+    * Api shared by many requests, stored once and referenced by id. The id is the first 8 bytes
+    * of the sha256 of the serialized api, so the same api always gets the same id.
+    */
+   struct [[eosio::table, eosio::contract("eosio.system")]] api_template {
+      uint64_t          id;
+      capi_checksum256  hash;
+      name              owner;
+      api               value;
+      uint64_t          refcount = 0; /// references of open requests, the template can be removed at 0
 
       uint64_t primary_key() const { return id; }
    };
-   typedef eosio::multi_index< "requests"_n, request_info > request_info_table;
+   typedef eosio::counted_multi_index< "apitemplates"_n, api_template > api_template_table;
+
+   typedef boost::container::flat_map< uint64_t, int64_t > template_refs_map;
+
+   /**
+    * Result of the last sweep of timed out requests and totals of all sweeps.
+    */
+   struct [[eosio::table("reqsweep"), eosio::contract("eosio.system")]] request_sweep_state {
+      time_point last_sweep;
+      uint32_t   last_rows = 0;
+      uint64_t   last_ram_bytes = 0;  /// RAM released by the last sweep, as billed by nodeos
+      uint64_t   total_rows = 0;
+      uint64_t   total_ram_bytes = 0;
+      name       next_caller;  /// caller the next sweep starts from, sweeps walk the callers round robin
+
+      EOSLIB_SERIALIZE( request_sweep_state, (last_sweep)(last_rows)(last_ram_bytes)(total_rows)(total_ram_bytes)(next_caller) )
+   };
+
+   typedef eosio::singleton< "reqsweep"_n, request_sweep_state > request_sweep_singleton;
+
+   /**
+    * Request of an addrequests batch, fields are the same as of addrequest.
+    */
+   struct oracle_request {
+      uint64_t         id;
+      std::vector<api> apis;
+      uint16_t         response_type;
+      uint16_t         aggregation_type;
+      uint16_t         prefered_api;
+      std::string      string_to_count;
+      std::vector<uint64_t> api_ids; /// ids of api templates, used after apis
+      uint8_t          oracle_count = 0; /// more than 1 sends the request to that many oracles and aggregates replies
+      uint8_t          quorum = 0;       /// replies needed for the aggregated result, 0 for a majority of oracle_count
+   };
+
+   static constexpr uint8_t max_aggregate_oracles = 21;
+
+   /**
+    * Streaming aggregate of replies to a request sent to several oracles. Replies are folded in
+    * as they arrive and are not stored, the row has the same size however many oracles reply.
+    */
+   struct [[eosio::table, eosio::contract("eosio.system")]] request_aggregate {
+      uint64_t          id;
+      std::vector<name> oracles;         /// oracles the request was sent to, at most max_aggregate_oracles
+      uint32_t          replied = 0;     /// bit i is set when oracles[i] has replied
+      uint8_t           quorum = 0;
+      uint8_t           count = 0;       /// replies folded in
+      uint8_t           true_votes = 0;  /// BOOLEAN: replies that were true
+      double            mean = 0;        /// MEAN, STD: running mean (Welford)
+      double            m2 = 0;          /// STD: running sum of squared differences from the mean (Welford)
+
+      uint64_t primary_key() const { return id; }
+
+      void add( double x ) {
+         count++;
+         const double delta = x - mean;
+         mean += delta / count;
+         m2   += delta * (x - mean);
+      }
+   };
+   typedef eosio::counted_multi_index< "aggregates"_n, request_aggregate > request_aggregate_table;
+
+   /**
+    * Response of a replybatch batch, fields are the same as of reply.
+    */
+   struct oracle_response {
+      uint64_t          request_id;
+      std::vector<char> response;
+   };
+
+   /**
+    * Oracle counter changes accumulated during one action, applied once per oracle.
+    */
+   struct oracle_counters_delta {
+      int32_t  pending_requests = 0;
+      uint32_t successful_requests = 0;
+      uint32_t failed_requests = 0;
+   };
+
+   typedef boost::container::flat_map< name, oracle_counters_delta > oracle_deltas_map;
 
 
    struct [[eosio::table("oraclereward"), eosio::contract("eosio.system")]] oracle_reward_info {
       uint32_t total_successful_requests = 0;
    };
-   typedef eosio::singleton< "oraclereward"_n, oracle_reward_info > oracle_reward_info_singleton;
+   typedef eosio::tracked_singleton< "oraclereward"_n, oracle_reward_info > oracle_reward_info_singleton;
+
+   /**
+    * Active oracles of the top 21 producers with their selection weights, rebuilt by
+    * update_elected_producers and setoracle so that addrequest does not walk the producers.
+    */
+   struct [[eosio::table("oracleroster"), eosio::contract("eosio.system")]] oracle_roster {
+      oracle_roster() { }
+      std::vector<name>       producers; /// top 21 producers the roster was built from, by total votes
+      std::vector<name>       oracles;   /// their distinct active oracle accounts, by pending requests in descending order
+      std::vector<uint32_t>   weights;   /// prefix sums of selection weights, oracles[i] covers [weights[i-1], weights[i])
+
+      EOSLIB_SERIALIZE( oracle_roster, (producers)(oracles)(weights) )
+   };
+
+   typedef eosio::tracked_singleton< "oracleroster"_n, oracle_roster > oracle_roster_singleton;
 
    class [[eosio::contract("eosio.system")]] system_contract : public native {
 
       private:
          voters_table            _voters;
+         voters_pay_table        _voterpay;
          producers_table         _producers;
          producers_table2        _producers2;
          producers_table3        _producers3;
-         global_state_singleton  _global;
-         global_state2_singleton _global2;
-         global_state3_singleton _global3;
-         global_state4_singleton _global4;
-         eosio_global_state      _gstate;
-         eosio_global_state2     _gstate2;
-         eosio_global_state3     _gstate3;
-         eosio_global_state4     _gstate4;
+         producers_pay_table     _producerpay;
+         eosio::lazy_state<global_state_singleton, eosio_global_state>   _gstate;
+         eosio::lazy_state<global_state2_singleton, eosio_global_state2> _gstate2;
+         eosio::lazy_state<global_state3_singleton, eosio_global_state3> _gstate3;
+         eosio::lazy_state<global_state4_singleton, eosio_global_state4> _gstate4;
+         eosio::lazy_state<global_counters_singleton, eosio_global_counters> _gcounters;
          rammarket               _rammarket;
          rex_pool_table          _rexpool;
          rex_fund_table          _rexfunds;
          rex_balance_table       _rexbalance;
          rex_order_table         _rexorders;
-         oracle_reward_info_singleton _oracle_global;
-         oracle_reward_info           _oracle_state;
+         eosio::lazy_state<oracle_reward_info_singleton, oracle_reward_info> _oracle_state;
          oracle_info_table            _oracles;
 
       public:
@@ -503,15 +897,64 @@ namespace eosiosystem {
 
          // functions defined in oracle.cpp
 
+         /**
+          * Adds a single request to the assigned and standby oracle. It cannot reference api templates,
+          * requests using them are added with addrequests.
+          */
          [[eosio::action]]
          void addrequest( uint64_t request_id, const eosio::name& caller, const std::vector<api>& apis, uint16_t response_type, uint16_t aggregation_type, uint16_t prefered_api, std::string string_to_count );
 
+         /**
+          * Adds several requests of caller at once, all of them are assigned to the same oracles.
+          */
+         [[eosio::action]]
+         void addrequests( const eosio::name& caller, const std::vector<oracle_request>& requests );
+
          [[eosio::action]]
          void reply( const eosio::name& caller, uint64_t request_id, const std::vector<char>& response );
 
+         /**
+          * Replies to several requests of caller at once, each response is handled as by reply.
+          */
+         [[eosio::action]]
+         void replybatch( const eosio::name& caller, const std::vector<oracle_response>& responses );
+
          [[eosio::action]]
          void setoracle( const eosio::name& producer, const eosio::name& oracle );
 
+         /**
+          * Result of a request aggregated from several oracles, sent by the system contract to
+          * notify the caller once the quorum of replies is reached.
+          */
+         [[eosio::action]]
+         void aggresult( const eosio::name& caller, uint64_t request_id, const std::vector<char>& result );
+
+         /**
+          * Stores api as a template that requests can reference by id. The id is the first 8 bytes of
+          * the sha256 of the serialized api read as a little endian uint64, clients compute it themselves.
+          */
+         [[eosio::action]]
+         void addapitmpl( const eosio::name& owner, const api& value );
+
+         /**
+          * Removes an api template that no open request references.
+          */
+         [[eosio::action]]
+         void rmapitmpl( uint64_t id );
+
+         /**
+          * Times out and erases up to max_rows requests that got no reply within both timeframes.
+          */
+         [[eosio::action]]
+         void sweepreqs( uint16_t max_rows );
+
+         /**
+          * Stores again up to max_rows requests of callers that were added before requests had the
+          * bytime index, and lists the callers in reqcallers, so that sweeps find their requests.
+          */
+         [[eosio::action]]
+         void backfillreqs( const std::vector<eosio::name>& callers, uint16_t max_rows );
+
          // functions defined in delegate_bandwidth.cpp
 
          /**
@@ -709,16 +1152,41 @@ namespace eosiosystem {
          [[eosio::action]]
          void voteproducer( const name voter, const name proxy, const std::vector<name>& producers );
 
+         [[eosio::action]]
+         void votebatch( const std::vector<name>& voters, const name proxy, const std::vector<name>& producers );
+
          [[eosio::action]]
          void regproxy( const name proxy, bool isproxy );
 
+         /**
+          * Registers vote power of up to max_rows voters that voted before the voter reward index
+          * existed, so that they earn voter rewards without voting again.
+          */
+         [[eosio::action]]
+         void backfillvpay( uint16_t max_rows );
+
          [[eosio::action]]
          void setparams( const eosio::blockchain_parameters& params );
 
+         /**
+          * Makes sure the global counters are moved out of the global singleton into globalcounts.
+          * Usually onblock of the first block after the deploy has moved them already, then nothing
+          * is left to do and the action succeeds without changes.
+          */
+         [[eosio::action]]
+         void migrateglob();
+
          // functions defined in producer_pay.cpp
          
          [[eosio::action]]
          void claimrewards( const name owner );
+
+         /**
+          * Pays producer rewards to a sorted list of producers in one pass, the same way claimrewards
+          * pays each of them. Requires authority of every listed producer.
+          */
+         [[eosio::action]]
+         void claimall( const std::vector<name>& owners );
          
          [[eosio::action]]
          void claimdapprwd( const name dapp_registry, const name owner, const name dapp );
@@ -729,6 +1197,37 @@ namespace eosiosystem {
          [[eosio::action]]
          void setvclaimprd( uint32_t period_in_days );
 
+         /**
+          * Issues inflation accrued since the last settlement and distributes it to the reward buckets
+          * without waiting for the end of the settlement period. Requires authority of the system account.
+          */
+         [[eosio::action]]
+         void settleinfl();
+
+         /**
+          * Sets how often accrued inflation is issued and distributed to the reward buckets.
+          */
+         [[eosio::action]]
+         void setinflprd( uint32_t period_in_hours );
+
+         /**
+          * Sets the split of settled inflation between funds and reward buckets, applied from the next settlement.
+          */
+         [[eosio::action]]
+         void setrwdrates( const reward_rates& rates );
+
+         /**
+          * Sets how many rows each housekeeping task may process per run, 0 disables it.
+          */
+         [[eosio::action]]
+         void setmaintrows( uint16_t rows_per_run );
+
+         /**
+          * Runs one housekeeping task, sent by onblock in a deferred transaction.
+          */
+         [[eosio::action]]
+         void maintain( uint8_t task );
+
          [[eosio::action]]
          void setpriv( name account, uint8_t is_priv );
 
@@ -778,11 +1277,19 @@ namespace eosiosystem {
          using setram_action = eosio::action_wrapper<"setram"_n, &system_contract::setram>;
          using setramrate_action = eosio::action_wrapper<"setramrate"_n, &system_contract::setramrate>;
          using voteproducer_action = eosio::action_wrapper<"voteproducer"_n, &system_contract::voteproducer>;
+         using votebatch_action = eosio::action_wrapper<"votebatch"_n, &system_contract::votebatch>;
          using regproxy_action = eosio::action_wrapper<"regproxy"_n, &system_contract::regproxy>;
          using claimrewards_action = eosio::action_wrapper<"claimrewards"_n, &system_contract::claimrewards>;
+         using claimall_action = eosio::action_wrapper<"claimall"_n, &system_contract::claimall>;
          using claimdapprwd_action = eosio::action_wrapper<"claimdapprwd"_n, &system_contract::claimdapprwd>;
          using claimvoterwd_action = eosio::action_wrapper<"claimvoterwd"_n, &system_contract::claimvoterwd>;
          using setvclaimprd_action = eosio::action_wrapper<"setvclaimprd"_n, &system_contract::setvclaimprd>;
+         using settleinfl_action = eosio::action_wrapper<"settleinfl"_n, &system_contract::settleinfl>;
+         using setinflprd_action = eosio::action_wrapper<"setinflprd"_n, &system_contract::setinflprd>;
+         using setrwdrates_action = eosio::action_wrapper<"setrwdrates"_n, &system_contract::setrwdrates>;
+         using setmaintrows_action = eosio::action_wrapper<"setmaintrows"_n, &system_contract::setmaintrows>;
+         using maintain_action = eosio::action_wrapper<"maintain"_n, &system_contract::maintain>;
+         using aggresult_action = eosio::action_wrapper<"aggresult"_n, &system_contract::aggresult>;
          using rmvproducer_action = eosio::action_wrapper<"rmvproducer"_n, &system_contract::rmvproducer>;
          using updtrevision_action = eosio::action_wrapper<"updtrevision"_n, &system_contract::updtrevision>;
          using bidname_action = eosio::action_wrapper<"bidname"_n, &system_contract::bidname>;
@@ -790,6 +1297,7 @@ namespace eosiosystem {
          using setpriv_action = eosio::action_wrapper<"setpriv"_n, &system_contract::setpriv>;
          using setalimits_action = eosio::action_wrapper<"setalimits"_n, &system_contract::setalimits>;
          using setparams_action = eosio::action_wrapper<"setparams"_n, &system_contract::setparams>;
+         using migrateglob_action = eosio::action_wrapper<"migrateglob"_n, &system_contract::migrateglob>;
 
       private:
 
@@ -803,6 +1311,7 @@ namespace eosiosystem {
 
          //defined in eosio.system.cpp
          static eosio_global_state get_default_parameters();
+         static eosio_global_counters get_legacy_counters( name code );
          static time_point current_time_point();
          static time_point_sec current_time_point_sec();
          static block_timestamp current_block_time();
@@ -810,7 +1319,7 @@ namespace eosiosystem {
          void update_ram_supply();
 
          // defined in rex.cpp
-         void runrex( uint16_t max );
+         uint16_t runrex( uint16_t max );
          void update_resource_limits( const name& from, const name& receiver, int64_t delta_net, int64_t delta_cpu );
          void check_voting_requirement( const name& owner,
                                         const char* error_msg = "must vote for at least 21 producers or for a proxy before buying REX" )const;
@@ -852,20 +1361,56 @@ namespace eosiosystem {
          // defined in voting.cpp
          void update_elected_producers( block_timestamp timestamp );
          void update_votes( const name voter, const name proxy, const std::vector<name>& producers, bool voting );
-         void propagate_weight_change( const voter_info& voter );
+         void accumulate_votes( const name voter, const name proxy, const std::vector<name>& producers, bool voting, producer_deltas_map& producer_deltas, voter_rewards_batch& rewards );
+         void cast_vote( const name voter, const name proxy, const std::vector<name>& producers, producer_deltas_map& producer_deltas, voter_rewards_batch& rewards );
+         void propagate_weight_change( const voter_info& voter, producer_deltas_map& producer_deltas, uint32_t depth = 0 );
+         void apply_producer_deltas( const producer_deltas_map& producer_deltas, bool voting, uint32_t max_deltas = max_producer_deltas );
+         void update_voter_pay( const voter_info& voter, voter_rewards_batch& rewards );
+         void apply_voter_rewards( const voter_rewards_batch& rewards );
+         int64_t voter_pay_power( const voter_info& voter )const;
+         void set_voter_pay( voters_pay_table::const_iterator pay, const name owner, int64_t vote_power, voter_reward_state& rewards, const name payer );
          // defined in voting.cpp -> for vote pay
-         double update_producer_votepay_share( const producers_table2::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero = false );
+         producers_pay_table::const_iterator find_producer_pay( const name& owner );
+         double update_producer_votepay_share( const producers_pay_table::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero = false );
          double update_total_votepay_share( time_point ct, double additional_shares_delta = 0.0, double shares_rate_delta = 0.0 );
          // defined in voting.cpp -> for witness pay
-         double update_producer_witnesspay_share( const producers_table3::const_iterator& prod3_itr, time_point ct, double shares_rate, bool reset_to_zero = false );
+         double update_producer_witnesspay_share( const producers_pay_table::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero = false );
          double update_total_witnesspay_share( time_point ct, double additional_shares_delta = 0.0, double shares_rate_delta = 0.0 );
+         std::vector<name> get_witnesses()const;
+         std::vector<name> get_current_witnesses()const;
+         void update_witnesses( const std::vector<name>& witnesses_before, time_point ct );
 
          // defined in oracle.cpp
          void check_response_type(uint16_t t) const;
+         oracle_roster current_oracle_roster() const;
          std::pair<name, name> get_current_oracle() const;
+         std::vector<name> select_oracles( uint8_t count ) const;
+         oracle_roster build_oracle_roster( const std::vector<name>& producers ) const;
+         void add_request( request_info_table& requests, const name caller, const oracle_request& request, const std::vector<name>& oracles, template_refs_map& template_refs );
+         void process_aggregated_reply( request_info_table& requests, const request_info& request, request_aggregate_table& aggregates, const request_aggregate& aggregate, const std::vector<char>& response, oracle_deltas_map& oracle_deltas, template_refs_map& template_refs );
+         void process_reply( request_info_table& requests, uint64_t request_id, const std::vector<char>& response, oracle_deltas_map& oracle_deltas, template_refs_map& template_refs );
+         void apply_oracle_deltas( const oracle_deltas_map& oracle_deltas );
+         void apply_template_refs( const template_refs_map& template_refs );
+         void erase_request( request_info_table& requests, const request_info& request, template_refs_map& template_refs );
+         uint16_t sweep_expired_requests( uint16_t max_rows );
+         void refresh_oracle_roster( const std::vector<name>& producers );
+
+         // defined in maintenance.cpp
+         enum class maintenance_task : uint8_t {
+            rex_queue = 0,
+            inflation,
+            oracle_requests,
+            count
+         };
+         void schedule_maintenance();
+         uint16_t run_maintenance_task( maintenance_task task, uint16_t max_rows );
 
          // defined in producer_pay.cpp
-         void share_inflation();
+         void flush_unpaid_blocks( unpaid_blocks_state& unpaid );
+         void claim_producer_rewards( const std::vector<name>& owners );
+         void share_inflation( bool force_settlement = false );
+         void settle_inflation( int64_t new_tokens, microseconds period );
+         void distribute_voter_rewards( int64_t amount, microseconds period );
          void payout_witness_reward();
 
          template <auto system_contract::*...Ptrs>
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <eosiolib/datastream.hpp>
+#include <eosiolib/db.h>
+#include <eosiolib/name.hpp>
+#include <eosiolib/system.hpp>
+#include <eosio.system/contract_stats.hpp>
+
+#include <optional>
+#include <vector>
+
+namespace eosio {
+
+   /**
+    *  Singleton that remembers the serialized value it was read with, so that a contract can
+    *  keep its state in a member for the duration of an action and write it back only if the
+    *  value was actually changed. Rows are stored as by eosio::singleton, but read and written
+    *  as raw bytes: the snapshot is the row as stored and a write stores the bytes that were
+    *  compared, so a value is serialized once per write and not at all per read.
+    */
+   template<name::raw SingletonName, typename T>
+   class tracked_singleton {
+      static constexpr uint64_t pk_value = static_cast<uint64_t>(SingletonName);
+
+      public:
+         tracked_singleton( name code, uint64_t scope ) :_code(code), _scope(scope) {}
+
+         bool exists() {
+            return find() >= 0;
+         }
+
+         T get() {
+            return unpack<T>( read() );
+         }
+
+         T get_or_default( const T& def = T() ) {
+            return exists() ? get() : def;
+         }
+
+         /**
+          *  Reads the stored value and remembers it for set_if_changed.
+          *
+          *  @pre value must exist
+          */
+         T get_tracked() {
+            _snapshot = read();
+            return unpack<T>( _snapshot );
+         }
+
+         /**
+          *  Reads the stored value if it exists, otherwise returns def. A value that was not read
+          *  from the table is always written by set_if_changed.
+          */
+         T get_tracked_or_default( const T& def = T() ) {
+            return exists() ? get_tracked() : def;
+         }
+
+         void set( const T& value, name payer ) {
+            write( pack( value ), payer );
+         }
+
+         /**
+          *  Writes value if its serialized form differs from the one that was read.
+          */
+         void set_if_changed( const T& value, name payer ) {
+            auto packed = pack( value );
+            if( packed == _snapshot ) {
+               return;
+            }
+            write( packed, payer );
+            _snapshot = std::move( packed );
+         }
+
+      private:
+         int32_t find() {
+            return db_find_i64( _code.value, _scope, pk_value, pk_value );
+         }
+
+         std::vector<char> read() {
+            const int32_t itr = find();
+            check( itr >= 0, "singleton does not exist" );
+            std::vector<char> data( db_get_i64( itr, nullptr, 0 ) );
+            db_get_i64( itr, data.data(), data.size() );
+            return data;
+         }
+
+         void write( const std::vector<char>& data, name payer ) {
+            const int32_t itr = find();
+            if( itr >= 0 ) {
+               db_update_i64( itr, payer.value, data.data(), data.size() );
+            } else {
+               db_store_i64( _scope, pk_value, payer.value, pk_value, data.data(), data.size() );
+            }
+            count_state_bytes( data.size() );
+         }
+
+         name              _code;
+         uint64_t          _scope;
+         std::vector<char> _snapshot;
+   };
+
+   /**
+    *  Value of a tracked_singleton that is read on first access instead of when the contract is
+    *  constructed. write_back stores the value only if it was accessed and changed, so an action
+    *  that never touches the state neither reads nor writes it.
+    */
+   template<typename Singleton, typename T>
+   class lazy_state {
+      public:
+         /// makes the value used when the singleton of contract code does not exist
+         using default_factory = T (*)( name code );
+
+         lazy_state( name code, uint64_t scope, default_factory def = nullptr )
+         :_code(code), _table(code, scope), _default(def) {}
+
+         T& get() {
+            load();
+            return *_value;
+         }
+
+         const T& get()const {
+            load();
+            return *_value;
+         }
+
+         T* operator->() { return &get(); }
+         const T* operator->()const { return &get(); }
+         T& operator*() { return get(); }
+         const T& operator*()const { return get(); }
+
+         bool loaded()const { return _value.has_value(); }
+
+         bool exists()const { return _table.exists(); }
+
+         /**
+          *  Writes the value back if it was loaded and changed.
+          */
+         void write_back( name payer ) {
+            if( _value ) {
+               _table.set_if_changed( *_value, payer );
+            }
+         }
+
+      private:
+         void load()const {
+            if( !_value ) {
+               _value = _table.exists() ? _table.get_tracked() : ( _default ? _default( _code ) : T() );
+            }
+         }
+
+         name                       _code;
+         mutable Singleton          _table;
+         default_factory            _default;
+         mutable std::optional<T>   _value;
+   };
+
+} /// namespace eosio
@@ -73,9 +73,9 @@ namespace eosiosystem {
     *  These tables are designed to be constructed in the scope of the relevant user, this
     *  facilitates simpler API for per-user queries
     */
-   typedef eosio::multi_index< "userres"_n, user_resources >      user_resources_table;
-   typedef eosio::multi_index< "delband"_n, delegated_bandwidth > del_bandwidth_table;
-   typedef eosio::multi_index< "refunds"_n, refund_request >      refunds_table;
+   typedef eosio::counted_multi_index< "userres"_n, user_resources >      user_resources_table;
+   typedef eosio::counted_multi_index< "delband"_n, delegated_bandwidth > del_bandwidth_table;
+   typedef eosio::counted_multi_index< "refunds"_n, refund_request >      refunds_table;
 
 
 
@@ -140,8 +140,8 @@ namespace eosiosystem {
 
       check( bytes_out > 0, "must reserve a positive amount" );
 
-      _gstate.total_ram_bytes_reserved += uint64_t(bytes_out);
-      _gstate.total_ram_stake          += quant_after_fee.amount;
+      _gcounters->total_ram_bytes_reserved += uint64_t(bytes_out);
+      _gcounters->total_ram_stake          += quant_after_fee.amount;
 
       user_resources_table  userres( _self, receiver.value );
       auto res_itr = userres.find( receiver.value );
@@ -192,11 +192,11 @@ namespace eosiosystem {
 
       check( tokens_out.amount > 1, "token amount received from selling ram is too low" );
 
-      _gstate.total_ram_bytes_reserved -= static_cast<decltype(_gstate.total_ram_bytes_reserved)>(bytes); // bytes > 0 is asserted above
-      _gstate.total_ram_stake          -= tokens_out.amount;
+      _gcounters->total_ram_bytes_reserved -= static_cast<decltype(_gcounters->total_ram_bytes_reserved)>(bytes); // bytes > 0 is asserted above
+      _gcounters->total_ram_stake          -= tokens_out.amount;
 
       //// this shouldn't happen, but just in case it does we should prevent it
-      check( _gstate.total_ram_stake >= 0, "error, attempt to unstake more tokens than previously staked" );
+      check( _gcounters->total_ram_stake >= 0, "error, attempt to unstake more tokens than previously staked" );
 
       userres.modify( res_itr, account, [&]( auto& res ) {
           res.ram_bytes -= bytes;
@@ -458,14 +458,17 @@ namespace eosiosystem {
       check( unstake_cpu_quantity >= zero_asset, "must unstake a positive amount" );
       check( unstake_net_quantity >= zero_asset, "must unstake a positive amount" );
       check( unstake_cpu_quantity.amount + unstake_net_quantity.amount > 0, "must unstake a positive amount" );
-      check( _gstate.total_activated_stake >= min_activated_stake,
+      check( _gcounters->total_activated_stake >= min_activated_stake,
              "cannot undelegate bandwidth until the chain is activated (at least 15% of all tokens participate in voting)" );
       auto producer_from_name = _voters.find(from.value);
       if(producer_from_name -> staked > 1000000){
+         const auto witnesses_before = get_current_witnesses();
          const auto& prod = _producers.get( from.value );
          _producers.modify(prod, same_payer, [&](auto& p) {
             p.deactivate();
          });
+         // the persisted witness set must not keep the deactivated producer, claimrewards pays from it
+         update_witnesses( witnesses_before, current_time_point() );
       }
       changebw( from, receiver, -unstake_net_quantity, -unstake_cpu_quantity, false);
    } // undelegatebw
@@ -8,33 +8,33 @@
 #include "exchange_state.cpp"
 #include "rex.cpp"
 #include "oracle.cpp"
+#include "maintenance.cpp"
 
 namespace eosiosystem {
 
    system_contract::system_contract( name s, name code, datastream<const char*> ds )
    :native(s,code,ds),
     _voters(_self, _self.value),
+    _voterpay(_self, _self.value),
     _producers(_self, _self.value),
     _producers2(_self, _self.value),
     _producers3(_self, _self.value),
-    _global(_self, _self.value),
-    _global2(_self, _self.value),
-    _global3(_self, _self.value),
-    _global4(_self, _self.value),
+    _producerpay(_self, _self.value),
+    _gstate(_self, _self.value, []( name ) { return get_default_parameters(); }),
+    _gstate2(_self, _self.value),
+    _gstate3(_self, _self.value),
+    _gstate4(_self, _self.value),
+    _gcounters(_self, _self.value, &system_contract::get_legacy_counters),
     _rammarket(_self, _self.value),
     _rexpool(_self, _self.value),
     _rexfunds(_self, _self.value),
     _rexbalance(_self, _self.value),
     _rexorders(_self, _self.value),
-    _oracle_global( get_self(), get_self().value ),
+    _oracle_state( get_self(), get_self().value ),
     _oracles( get_self(), get_self().value )
    {
       //print( "construct system\n" );
-      _gstate  = _global.exists() ? _global.get() : get_default_parameters();
-      _gstate2 = _global2.exists() ? _global2.get() : eosio_global_state2{};
-      _gstate3 = _global3.exists() ? _global3.get() : eosio_global_state3{};
-      _gstate4 = _global4.exists() ? _global4.get() : eosio_global_state4{};
-      _oracle_state = _oracle_global.get_or_create(get_self(), oracle_reward_info{});      
+      // global state blocks are read on first access, see eosio::lazy_state
    }
 
    eosio_global_state system_contract::get_default_parameters() {
@@ -43,6 +43,32 @@ namespace eosiosystem {
       return dp;
    }
 
+   /**
+    *  Counters as they are stored in the global singleton before the migration to globalcounts.
+    */
+   eosio_global_counters system_contract::get_legacy_counters( name code ) {
+      global_state_singleton global( code, code.value );
+      const auto gs = global.exists() ? global.get() : get_default_parameters();
+      eosio_global_counters counters;
+      counters.total_ram_bytes_reserved          = gs.total_ram_bytes_reserved;
+      counters.total_ram_stake                   = gs.total_ram_stake;
+      counters.last_producer_schedule_update     = gs.last_producer_schedule_update;
+      counters.last_pervote_bucket_fill          = gs.last_pervote_bucket_fill;
+      counters.last_dapp_bucket_fill             = gs.last_dapp_bucket_fill;
+      counters.perblock_bucket                   = gs.perblock_bucket;
+      counters.pervote_bucket                    = gs.pervote_bucket;
+      counters.perwitness_bucket                 = gs.perwitness_bucket;
+      counters.dapps_per_transfer_rewards_bucket = gs.dapps_per_transfer_rewards_bucket;
+      counters.dapps_per_user_rewards_bucket     = gs.dapps_per_user_rewards_bucket;
+      counters.total_unpaid_blocks               = gs.total_unpaid_blocks;
+      counters.total_unpaid_votes                = gs.total_unpaid_votes;
+      counters.oracle_bucket                     = gs.oracle_bucket;
+      counters.total_activated_stake             = gs.total_activated_stake;
+      counters.total_producer_vote_weight        = gs.total_producer_vote_weight;
+      counters.last_name_close                   = gs.last_name_close;
+      return counters;
+   }
+
    time_point system_contract::current_time_point() {
       const static time_point ct{ microseconds{ static_cast<int64_t>( current_time() ) } };
       return ct;
@@ -64,21 +90,23 @@ namespace eosiosystem {
    }
 
    system_contract::~system_contract() {
-      _global.set( _gstate, _self );
-      _global2.set( _gstate2, _self );
-      _global3.set( _gstate3, _self );
-      _global4.set( _gstate4, _self );
-      _oracle_global.set( _oracle_state, get_self() );
+      // global state is written back only if the action loaded and changed it
+      _gstate.write_back( _self );
+      _gstate2.write_back( _self );
+      _gstate3.write_back( _self );
+      _gstate4.write_back( _self );
+      _gcounters.write_back( _self );
+      _oracle_state.write_back( get_self() );
    }
 
    void system_contract::setram( uint64_t max_ram_size ) {
       require_auth( _self );
 
-      check( _gstate.max_ram_size < max_ram_size, "ram may only be increased" ); /// decreasing ram might result market maker issues
+      check( _gstate->max_ram_size < max_ram_size, "ram may only be increased" ); /// decreasing ram might result market maker issues
       check( max_ram_size < 1024ll*1024*1024*1024*1024, "ram size is unrealistic" );
-      check( max_ram_size > _gstate.total_ram_bytes_reserved, "attempt to set max below reserved" );
+      check( max_ram_size > _gcounters->total_ram_bytes_reserved, "attempt to set max below reserved" );
 
-      auto delta = int64_t(max_ram_size) - int64_t(_gstate.max_ram_size);
+      auto delta = int64_t(max_ram_size) - int64_t(_gstate->max_ram_size);
       auto itr = _rammarket.find(ramcore_symbol.raw());
 
       /**
@@ -88,17 +116,17 @@ namespace eosiosystem {
          m.base.balance.amount += delta;
       });
 
-      _gstate.max_ram_size = max_ram_size;
+      _gstate->max_ram_size = max_ram_size;
    }
 
    void system_contract::update_ram_supply() {
       auto cbt = current_block_time();
 
-      if( cbt <= _gstate2.last_ram_increase ) return;
+      if( cbt <= _gstate2->last_ram_increase ) return;
 
       auto itr = _rammarket.find(ramcore_symbol.raw());
-      auto new_ram = (cbt.slot - _gstate2.last_ram_increase.slot)*_gstate2.new_ram_per_block;
-      _gstate.max_ram_size += new_ram;
+      auto new_ram = (cbt.slot - _gstate2->last_ram_increase.slot)*_gstate2->new_ram_per_block;
+      _gstate->max_ram_size += new_ram;
 
       /**
        *  Increase the amount of ram for sale based upon the change in max ram size.
@@ -106,7 +134,7 @@ namespace eosiosystem {
       _rammarket.modify( itr, same_payer, [&]( auto& m ) {
          m.base.balance.amount += new_ram;
       });
-      _gstate2.last_ram_increase = cbt;
+      _gstate2->last_ram_increase = cbt;
    }
 
    /**
@@ -120,16 +148,21 @@ namespace eosiosystem {
       require_auth( _self );
 
       update_ram_supply();
-      _gstate2.new_ram_per_block = bytes_per_block;
+      _gstate2->new_ram_per_block = bytes_per_block;
    }
 
    void system_contract::setparams( const eosio::blockchain_parameters& params ) {
       require_auth( _self );
-      (eosio::blockchain_parameters&)(_gstate) = params;
-      check( 3 <= _gstate.max_authority_depth, "max_authority_depth should be at least 3" );
+      (eosio::blockchain_parameters&)(*_gstate) = params;
+      check( 3 <= _gstate->max_authority_depth, "max_authority_depth should be at least 3" );
       set_blockchain_parameters( params );
    }
 
+   void system_contract::migrateglob() {
+      require_auth( _self );
+      _gcounters.get(); // if globalcounts does not exist yet, copied from the global singleton and stored by the destructor
+   }
+
    void system_contract::setpriv( name account, uint8_t ispriv ) {
       require_auth( _self );
       set_privileged( account.value, ispriv );
@@ -290,18 +323,20 @@ namespace eosiosystem {
       require_auth( _self );
       auto prod = _producers.find( producer.value );
       check( prod != _producers.end(), "producer not found" );
+      const auto witnesses_before = get_current_witnesses();
       _producers.modify( prod, same_payer, [&](auto& p) {
             p.deactivate();
          });
+      update_witnesses( witnesses_before, current_time_point() );
    }
 
    void system_contract::updtrevision( uint8_t revision ) {
       require_auth( _self );
-      check( _gstate2.revision < 255, "can not increment revision" ); // prevent wrap around
-      check( revision == _gstate2.revision + 1, "can only increment revision by one" );
+      check( _gstate2->revision < 255, "can not increment revision" ); // prevent wrap around
+      check( revision == _gstate2->revision + 1, "can only increment revision by one" );
       check( revision <= 1, // set upper bound to greatest revision supported in the code
                     "specified revision is not yet supported by the code" );
-      _gstate2.revision = revision;
+      _gstate2->revision = revision;
    }
 
    void system_contract::bidname( name bidder, name newname, asset bid ) {
@@ -455,7 +490,7 @@ namespace eosiosystem {
       _rammarket.emplace( _self, [&]( auto& m ) {
          m.supply.amount = 100000000000000ll;
          m.supply.symbol = ramcore_symbol;
-         m.base.balance.amount = int64_t(_gstate.free_ram());
+         m.base.balance.amount = int64_t(_gstate->max_ram_size - _gcounters->total_ram_bytes_reserved);
          m.base.balance.symbol = ram_symbol;
          m.quote.balance.amount = system_token_supply.amount / 1000;
          m.quote.balance.symbol = core;
@@ -468,11 +503,11 @@ namespace eosiosystem {
 } /// eosio.system
 
 
-EOSIO_DISPATCH( eosiosystem::system_contract,
+EOSIO_DISPATCH_WITH_STATS( eosiosystem::system_contract,
      // native.hpp (newaccount definition is actually in eosio.system.cpp)
      (newaccount)(updateauth)(deleteauth)(linkauth)(unlinkauth)(canceldelay)(onerror)(setabi)
      // eosio.system.cpp
-     (init)(setram)(setramrate)(setparams)(setpriv)(setalimits)(setacctram)(setacctnet)(setacctcpu)
+     (init)(setram)(setramrate)(setparams)(migrateglob)(setpriv)(setalimits)(setacctram)(setacctnet)(setacctcpu)
      (rmvproducer)(updtrevision)(bidname)(bidrefund)
      // rex.cpp
      (deposit)(withdraw)(buyrex)(unstaketorex)(sellrex)(cnclrexorder)(rentcpu)(rentnet)(fundcpuloan)(fundnetloan)
@@ -480,9 +515,9 @@ EOSIO_DISPATCH( eosiosystem::system_contract,
      // delegate_bandwidth.cpp
      (buyrambytes)(buyram)(sellram)(delegatebw)(undelegatebw)(refund)
      // voting.cpp
-     (regproducer)(unregprod)(voteproducer)(regproxy)
+     (regproducer)(unregprod)(voteproducer)(votebatch)(regproxy)(backfillvpay)
      // producer_pay.cpp
-     (onblock)(claimrewards)(claimdapprwd)(claimvoterwd)(setvclaimprd)
+     (onblock)(claimrewards)(claimall)(claimdapprwd)(claimvoterwd)(setvclaimprd)(settleinfl)(setinflprd)(setrwdrates)(setmaintrows)(maintain)
      //oracle.cpp
-     (addrequest)(reply)(setoracle)
+     (addrequest)(addrequests)(reply)(replybatch)(aggresult)(setoracle)(addapitmpl)(rmapitmpl)(sweepreqs)(backfillreqs)
 )
@@ -0,0 +1,86 @@
+#include <eosio.system/eosio.system.hpp>
+
+
+namespace eosiosystem {
+
+   static constexpr uint128_t maintenance_sender_id = uint128_t("maintenance"_n.value) << 64;
+
+   /**
+    *  Schedules housekeeping from onblock. Every task runs in its own deferred transaction, so a
+    *  failing task, for example an inline transfer of inflation settlement, neither aborts onblock
+    *  nor stops the other tasks. A task that is still pending is replaced.
+    */
+   void system_contract::schedule_maintenance() {
+      maintenance_singleton maintenance_table( _self, _self.value );
+      if( maintenance_table.get_or_default().rows_per_run == 0 ) {
+         return;
+      }
+
+      constexpr uint8_t task_count = static_cast<uint8_t>( maintenance_task::count );
+      for( uint8_t task = 0; task < task_count; ++task ) {
+         transaction t;
+         t.actions.emplace_back( permission_level{_self, active_permission},
+                                 _self, "maintain"_n,
+                                 std::make_tuple( task )
+         );
+         t.delay_sec = 0;
+         cancel_deferred( maintenance_sender_id | task ); // TODO: Remove this line when replacing deferred trxs is fixed
+         t.send( maintenance_sender_id | task, _self, true );
+      }
+   }
+
+   void system_contract::maintain( uint8_t task ) {
+      require_auth( _self );
+      check( task < static_cast<uint8_t>( maintenance_task::count ), "unknown maintenance task" );
+
+      maintenance_singleton maintenance_table( _self, _self.value );
+      run_maintenance_task( static_cast<maintenance_task>( task ), maintenance_table.get_or_default().rows_per_run );
+   }
+
+   /**
+    *  Runs one housekeeping task.
+    *
+    *  @return number of rows processed, never more than max_rows
+    */
+   uint16_t system_contract::run_maintenance_task( maintenance_task task, uint16_t max_rows ) {
+      switch( task ) {
+         case maintenance_task::rex_queue: {
+            // runrex processes up to max of each of cpu loans, net loans and sellrex orders
+            const uint16_t max = max_rows / 3;
+            if( max == 0 || !rex_system_initialized() ) {
+               return 0;
+            }
+            return runrex( max );
+         }
+
+         case maintenance_task::inflation: {
+            if( _gcounters->total_activated_stake < min_activated_stake || _gcounters->last_pervote_bucket_fill == time_point() ) {
+               return 0;
+            }
+            inflation_state_singleton inflation_table( _self, _self.value );
+            const auto inflation = inflation_table.get_or_default();
+            if( current_time_point() - inflation.last_settlement < inflation.settlement_period ) {
+               return 0;
+            }
+            share_inflation( true );
+            return 1;
+         }
+
+         case maintenance_task::oracle_requests:
+            return sweep_expired_requests( max_rows );
+
+         default:
+            return 0;
+      }
+   }
+
+   void system_contract::setmaintrows( uint16_t rows_per_run ) {
+      require_auth( _self );
+
+      maintenance_singleton maintenance_table( _self, _self.value );
+      auto maintenance = maintenance_table.get_or_default();
+      maintenance.rows_per_run = rows_per_run;
+      maintenance_table.set( maintenance, _self );
+   }
+
+} //namespace eosiosystem
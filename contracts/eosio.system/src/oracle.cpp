@@ -1,51 +1,293 @@
 #include <eosio.system/eosio.system.hpp>
 
+#include <cmath>
+
 
 namespace eosiosystem {
    static constexpr uint16_t max_api_count  = 10;
+   static constexpr uint16_t max_batch_size = 50;
    static const microseconds request_period = eosio::minutes( 5 );
 
+   // RAM billed by nodeos besides the serialized row, billable_size in chain/contract_table_objects.hpp:
+   // a row is 44 bytes and an index128 entry 40 bytes, each with 32 bytes per chainbase index they are in
+   static constexpr uint64_t row_ram_overhead      = 44 + 2 * 32;
+   static constexpr uint64_t index128_ram_overhead = 40 + 3 * 32;
+
+   static void check_api( const api& a )
+   {
+      check( a.endpoint.substr(0, 5) == std::string("https"), "invalid endpoint" );
+      check( !a.json_field.empty(), "empty json field" );
+      //TODO: add aggregation type check
+   }
+
 
    void system_contract::addrequest( uint64_t request_id, const eosio::name& caller, const std::vector<api>& apis, uint16_t response_type, uint16_t aggregation_type, uint16_t prefered_api, std::string string_to_count )
+   {
+      addrequests( caller, { oracle_request{ request_id, apis, response_type, aggregation_type, prefered_api, string_to_count } } );
+   }
+
+   void system_contract::addrequests( const eosio::name& caller, const std::vector<oracle_request>& requests )
    {
       require_auth( caller );
 
-      check( apis.size() <= max_api_count, "number of endpoints is too large" );
-      for (const auto& api: apis) {
-         check( api.endpoint.substr(0, 5) == std::string("https"), "invalid endpoint" );
-         check( !api.json_field.empty(), "empty json field" );
-         //TODO: add aggregation type check
+      check( !requests.empty(), "no requests" );
+      check( requests.size() <= max_batch_size, "too many requests in one batch" );
+
+      // oracles are selected once per batch, requests of the batch go to the same assigned and standby
+      // oracle or, if aggregated, to the same oracles for the same oracle_count (0 stands for the pair)
+      boost::container::flat_map< uint8_t, std::vector<name> > selections;
+      request_info_table requests_table( get_self(), caller.value );
+      template_refs_map template_refs;
+      oracle_deltas_map oracle_deltas;
+      for (const auto& request: requests) {
+         const uint8_t oracle_count = request.oracle_count > 1 ? request.oracle_count : 0;
+         auto& oracles = selections[oracle_count];
+         if (oracles.empty()) {
+            if (oracle_count == 0) {
+               const auto [assigned_oracle, standby_oracle] = get_current_oracle();
+               oracles = { assigned_oracle, standby_oracle };
+            }
+            else {
+               oracles = select_oracles( oracle_count );
+            }
+         }
+         add_request( requests_table, caller, request, oracles, template_refs );
+
+         if (oracle_count == 0) {
+            oracle_deltas[oracles[0]].pending_requests++;
+         }
+         else {
+            for (const auto& oracle: oracles) {
+               oracle_deltas[oracle].pending_requests++;
+            }
+         }
       }
-      check_response_type( response_type );
+      apply_template_refs( template_refs );
+      apply_oracle_deltas( oracle_deltas );
 
+      request_caller_table callers( get_self(), get_self().value );
+      if (callers.find( caller.value ) == callers.end()) {
+         callers.emplace( caller, [&]( auto& c ) {
+            c.caller = caller;
+         });
+      }
+   }
+
+   void system_contract::reply( const eosio::name& caller, uint64_t request_id, const std::vector<char>& response )
+   {
       request_info_table requests( get_self(), caller.value );
-      check( requests.find( request_id ) == requests.end(), "request with this id already exists" );
+      oracle_deltas_map oracle_deltas;
+      template_refs_map template_refs;
+      process_reply( requests, request_id, response, oracle_deltas, template_refs );
+      apply_oracle_deltas( oracle_deltas );
+      apply_template_refs( template_refs );
 
-      const auto [assigned_oracle, standby_oracle] = get_current_oracle();
-      auto idx = _oracles.get_index<"oracleacc"_n>();
-      const auto it = idx.find(assigned_oracle.value);
-      idx.modify(it, same_payer, [](auto& o) {
-         o.pending_requests++;
+      require_recipient(caller);
+   }
+
+   void system_contract::replybatch( const eosio::name& caller, const std::vector<oracle_response>& responses )
+   {
+      check( !responses.empty(), "no responses" );
+      check( responses.size() <= max_batch_size, "too many responses in one batch" );
+
+      request_info_table requests( get_self(), caller.value );
+      oracle_deltas_map oracle_deltas;
+      template_refs_map template_refs;
+      for (const auto& r: responses) {
+         process_reply( requests, r.request_id, r.response, oracle_deltas, template_refs );
+      }
+      apply_oracle_deltas( oracle_deltas );
+      apply_template_refs( template_refs );
+
+      require_recipient(caller);
+   }
+
+   void system_contract::aggresult( const eosio::name& caller, uint64_t request_id, const std::vector<char>& result )
+   {
+      require_auth( get_self() );
+      require_recipient( caller );
+   }
+
+   void system_contract::addapitmpl( const eosio::name& owner, const api& value )
+   {
+      require_auth( owner );
+      check_api( value );
+
+      const auto packed = pack( value );
+      capi_checksum256 hash;
+      sha256( packed.data(), packed.size(), &hash );
+      uint64_t id;
+      memcpy( &id, hash.hash, sizeof(id) );
+
+      api_template_table templates( get_self(), get_self().value );
+      const auto it = templates.find( id );
+      if (it != templates.end()) {
+         check( std::equal( std::begin(hash.hash), std::end(hash.hash), std::begin(it->hash.hash) ), "api template id collision" );
+         check( false, "api template already exists" );
+      }
+      templates.emplace( owner, [&]( auto& t ) {
+         t.id       = id;
+         t.hash     = hash;
+         t.owner    = owner;
+         t.value    = value;
+         t.refcount = 0;
       });
+   }
+
+   void system_contract::rmapitmpl( uint64_t id )
+   {
+      api_template_table templates( get_self(), get_self().value );
+      const auto& t = templates.get( id, "api template is missing" );
+      require_auth( t.owner );
+      check( t.refcount == 0, "api template is used by open requests" );
+      templates.erase( t );
+   }
+
+   void system_contract::sweepreqs( uint16_t max_rows )
+   {
+      check( max_rows > 0, "max_rows must be positive" );
+      const uint16_t rows = sweep_expired_requests( max_rows );
+      check( rows > 0, "no timed out requests" );
+   }
+
+   void system_contract::backfillreqs( const std::vector<eosio::name>& callers, uint16_t max_rows )
+   {
+      require_auth( get_self() );
+      check( !callers.empty(), "no callers" );
+      check( max_rows > 0, "max_rows must be positive" );
+
+      request_caller_table caller_table( get_self(), get_self().value );
+      uint16_t rows = 0;
+      for (const auto& caller: callers) {
+         request_info_table requests( get_self(), caller.value );
+         auto idx = requests.get_index<"bytime"_n>();
+         for (auto it = requests.begin(); it != requests.end() && rows < max_rows; ) {
+            if (idx.find( it->by_time() ) != idx.end()) {
+               ++it;
+               continue;
+            }
+            // erase skips the missing index entry, the row is stored again with its bytime entry
+            const request_info row = *it;
+            it = requests.erase( it );
+            requests.emplace( get_self(), [&]( auto& r ) {
+               r = row;
+            });
+            rows++;
+         }
+         if (requests.begin() != requests.end() && caller_table.find( caller.value ) == caller_table.end()) {
+            caller_table.emplace( get_self(), [&]( auto& c ) {
+               c.caller = caller;
+            });
+         }
+      }
+   }
+
+   void system_contract::setoracle( const eosio::name& producer, const eosio::name& oracle )
+   {
+      require_auth(producer);
+
+      check( _producers.find(producer.value) != _producers.end(), "only block producer is allowed to set it`s oracle" );
 
-      requests.emplace( caller, [&, assigned=assigned_oracle, standby=standby_oracle]( auto& r ) {
-         r.id               = request_id;
+      const auto ct = current_time_point();
+      auto it = _oracles.find(producer.value);
+      if (it == _oracles.end()) {
+         _oracles.emplace(producer, [&](auto& o) {
+            o.producer                 = producer;
+            o.oracle_account           = oracle;
+            o.pending_requests         = 0;
+            o.successful_requests      = 0;
+            o.failed_requests          = 0;
+            o.pending_punishment       = 0;
+         });
+      }
+      else {
+         _oracles.modify(it, same_payer, [&](auto& o) {
+            o.oracle_account = oracle;
+         });
+      }
+
+      // oracle of a top 21 producer changed, rebuild the roster used by addrequest
+      oracle_roster_singleton roster_table( get_self(), get_self().value );
+      if (roster_table.exists()) {
+         const auto roster = roster_table.get();
+         if (std::find(roster.producers.begin(), roster.producers.end(), producer) != roster.producers.end()) {
+            refresh_oracle_roster(roster.producers);
+         }
+      }
+   }
+
+
+   void system_contract::check_response_type(uint16_t t) const
+   {
+      check( t >= 0 && t < static_cast<uint16_t>( response_type::MaxVal ), "response type is out of range" );
+   }
+
+   void system_contract::add_request( request_info_table& requests, const name caller, const oracle_request& request, const std::vector<name>& oracles, template_refs_map& template_refs )
+   {
+      check( request.apis.size() + request.api_ids.size() <= max_api_count, "number of endpoints is too large" );
+      for (const auto& api: request.apis) {
+         check_api( api );
+      }
+      // templates were checked when they were added, their existence is checked by apply_template_refs
+      for (const auto id: request.api_ids) {
+         template_refs[id]++;
+      }
+      check_response_type( request.response_type );
+
+      check( requests.find( request.id ) == requests.end(), "request with this id already exists" );
+
+      if (request.oracle_count > 1) {
+         if (request.aggregation_type == static_cast<uint16_t>( aggregation::BOOLEAN )) {
+            check( request.response_type == static_cast<uint16_t>( response_type::Bool ), "BOOLEAN aggregation requires Bool responses" );
+         }
+         else {
+            check( request.aggregation_type == static_cast<uint16_t>( aggregation::MEAN ) || request.aggregation_type == static_cast<uint16_t>( aggregation::STD ),
+               "aggregation type is out of range" );
+            check( request.response_type == static_cast<uint16_t>( response_type::Int ) || request.response_type == static_cast<uint16_t>( response_type::Double ),
+               "MEAN and STD aggregation require Int or Double responses" );
+         }
+         check( request.quorum <= request.oracle_count, "quorum is larger than oracle count" );
+
+         request_aggregate_table aggregates( get_self(), caller.value );
+         aggregates.emplace( caller, [&]( auto& a ) {
+            a.id      = request.id;
+            a.oracles = oracles;
+            a.quorum  = request.quorum > 0 ? request.quorum : request.oracle_count / 2 + 1;
+         });
+      }
+
+      requests.emplace( caller, [&]( auto& r ) {
+         r.id               = request.id;
          r.time             = current_time_point();
-         r.assigned_oracle  = assigned;
-         r.standby_oracle   = standby;
-         r.apis             = apis;
-         r.response_type    = response_type;
-         r.aggregation_type = aggregation_type;
-         r.prefered_api     = prefered_api;
-         r.string_to_count  = string_to_count;
+         r.assigned_oracle  = oracles[0];
+         r.standby_oracle   = oracles[1];
+         r.apis             = request.apis;
+         r.response_type    = request.response_type;
+         r.aggregation_type = request.aggregation_type;
+         r.prefered_api     = request.prefered_api;
+         r.string_to_count  = request.string_to_count;
+         if (!request.api_ids.empty()) {
+            r.api_ids.emplace( request.api_ids );
+         }
       });
    }
 
-   void system_contract::reply( const eosio::name& caller, uint64_t request_id, const std::vector<char>& response )
+   /**
+    *  Checks authorization of a reply to request_id and erases the request. Changes of oracle
+    *  counters are added to oracle_deltas instead of being written.
+    */
+   void system_contract::process_reply( request_info_table& requests, uint64_t request_id, const std::vector<char>& response, oracle_deltas_map& oracle_deltas, template_refs_map& template_refs )
    {
       const auto ct = current_time_point();
-      request_info_table requests( get_self(), caller.value );
       const auto& request = requests.get(request_id, "request is missing");
+
+      request_aggregate_table aggregates( get_self(), requests.get_scope() );
+      const auto aggregate = aggregates.find( request_id );
+      if (aggregate != aggregates.end()) {
+         process_aggregated_reply( requests, request, aggregates, *aggregate, response, oracle_deltas, template_refs );
+         return;
+      }
+
       bool first_timeframe = false;
       bool second_timeframe = false;
       bool timeout = false;
@@ -63,133 +305,373 @@ namespace eosiosystem {
       }
 
       name succeeded; // account that successfully executed request (it is either assigned oracle or standby)
-      auto idx = _oracles.get_index<"oracleacc"_n>();
-      auto it = idx.find(request.assigned_oracle.value);
-      if (it != idx.end()) {
-         if (first_timeframe) {
-            succeeded = request.assigned_oracle;
-         }
-         idx.modify(it, same_payer, [&](auto& o) {
-            o.pending_requests--;
-            if (!first_timeframe) {
-               o.failed_requests++;
-            }
-         });
+      auto& assigned = oracle_deltas[request.assigned_oracle];
+      assigned.pending_requests--;
+      if (first_timeframe) {
+         succeeded = request.assigned_oracle;
+      }
+      else {
+         assigned.failed_requests++;
       }
 
       if (second_timeframe) {
          succeeded = request.standby_oracle;
       }
       else if (timeout && request.standby_oracle) {
-         auto it = idx.find(request.standby_oracle.value);
-         if (it != idx.end()) {
-            idx.modify(it, same_payer, [&](auto &o) {
-               o.failed_requests++;
-            });
-         }
+         oracle_deltas[request.standby_oracle].failed_requests++;
       }
 
       if (succeeded) {
          // increment successful request counter for oracle that have successfully executed request
-         auto it = idx.find(succeeded.value);
-         if (it != idx.end()) {
-            idx.modify(it, same_payer, [&](auto &o) {
-               o.successful_requests++;
-            });
-            check( _oracle_state.total_successful_requests != std::numeric_limits<decltype(_oracle_state.total_successful_requests)>::max(),
-               "total_successful_requests overflow" );
-            _oracle_state.total_successful_requests++;
-         }
+         oracle_deltas[succeeded].successful_requests++;
       }
 
-      require_recipient(caller);
-
-      requests.erase(request);
+      erase_request( requests, request, template_refs );
    }
 
-   void system_contract::setoracle( const eosio::name& producer, const eosio::name& oracle )
+   /**
+    *  Folds a reply to a request sent to several oracles into its aggregate. Each of the oracles
+    *  can reply once within both timeframes. When quorum replies are in, the result is sent to
+    *  the caller by aggresult and oracles that have not replied are released without penalty.
+    *  After timeout only an empty reply is allowed and oracles that have not replied fail.
+    */
+   void system_contract::process_aggregated_reply( request_info_table& requests, const request_info& request, request_aggregate_table& aggregates, const request_aggregate& aggregate,
+                                                   const std::vector<char>& response, oracle_deltas_map& oracle_deltas, template_refs_map& template_refs )
    {
-      require_auth(producer);
+      const auto ct = current_time_point();
+      const name caller( requests.get_scope() );
+      if (ct - request.time >= request_period + request_period) {
+         check( response.empty(), "only empty response is allowed if request is timed out" );
+         for (size_t i = 0; i < aggregate.oracles.size(); i++) {
+            if (!(aggregate.replied & (1u << i))) {
+               auto& delta = oracle_deltas[aggregate.oracles[i]];
+               delta.pending_requests--;
+               delta.failed_requests++;
+            }
+         }
+         aggregates.erase( aggregate );
+         erase_request( requests, request, template_refs );
+         return;
+      }
 
-      check( _producers.find(producer.value) != _producers.end(), "only block producer is allowed to set it`s oracle" );
+      // the reply counts for the first oracle of the request that signed it and has not replied yet
+      size_t index = 0;
+      while (index < aggregate.oracles.size() && ((aggregate.replied & (1u << index)) || !has_auth(aggregate.oracles[index]))) {
+         index++;
+      }
+      check( index < aggregate.oracles.size(), "missing authority of an oracle that has not replied" );
+      auto& delta = oracle_deltas[aggregate.oracles[index]];
+      delta.pending_requests--;
+      delta.successful_requests++;
 
-      const auto ct = current_time_point();
-      auto it = _oracles.find(producer.value);
-      if (it == _oracles.end()) {
-         _oracles.emplace(producer, [&](auto& o) {
-            o.producer                 = producer;
-            o.oracle_account           = oracle;
-            o.pending_requests         = 0;
-            o.successful_requests      = 0;
-            o.failed_requests          = 0;
-            o.pending_punishment       = 0;
-         });
+      request_aggregate updated = aggregate;
+      updated.replied |= 1u << index;
+      if (request.aggregation_type == static_cast<uint16_t>( aggregation::BOOLEAN )) {
+         check( response.size() == 1 && (response[0] == 0 || response[0] == 1), "response must be a serialized bool" );
+         updated.count++;
+         updated.true_votes += response[0];
+      }
+      else if (request.response_type == static_cast<uint16_t>( response_type::Int )) {
+         check( response.size() == sizeof(int64_t), "response must be a serialized int64" );
+         updated.add( static_cast<double>( unpack<int64_t>( response ) ) );
       }
       else {
-         _oracles.modify(it, same_payer, [&](auto& o) {
-            o.oracle_account = oracle;
+         check( response.size() == sizeof(double), "response must be a serialized double" );
+         const double value = unpack<double>( response );
+         check( std::isfinite( value ), "response must be a finite number" );
+         updated.add( value );
+      }
+      check( std::isfinite( updated.mean ) && std::isfinite( updated.m2 ), "response is out of range of the aggregate" );
+
+      if (updated.count < updated.quorum) {
+         aggregates.modify( aggregate, same_payer, [&]( auto& a ) {
+            a = updated;
          });
+         return;
       }
+
+      for (size_t i = 0; i < updated.oracles.size(); i++) {
+         if (!(updated.replied & (1u << i))) {
+            oracle_deltas[updated.oracles[i]].pending_requests--;
+         }
+      }
+
+      std::vector<char> result;
+      switch (static_cast<aggregation>( request.aggregation_type )) {
+         case aggregation::MEAN:
+            result = pack( updated.mean );
+            break;
+         case aggregation::STD:
+            result = pack( std::sqrt( updated.m2 / updated.count ) );
+            break;
+         case aggregation::BOOLEAN:
+            result = pack( updated.true_votes * 2 > updated.count );
+            break;
+      }
+      aggresult_action aggresult_act{ get_self(), { get_self(), active_permission } };
+      aggresult_act.send( caller, request.id, result );
+
+      aggregates.erase( aggregate );
+      erase_request( requests, request, template_refs );
    }
 
+   void system_contract::erase_request( request_info_table& requests, const request_info& request, template_refs_map& template_refs )
+   {
+      if (request.api_ids.has_value()) {
+         for (const auto id: request.api_ids.value()) {
+            template_refs[id]--;
+         }
+      }
+      requests.erase(request);
+   }
 
-   void system_contract::check_response_type(uint16_t t) const
+   /**
+    *  Writes accumulated reference count changes, one modify per template.
+    */
+   void system_contract::apply_template_refs( const template_refs_map& template_refs )
    {
-      check( t >= 0 && t < static_cast<uint16_t>( response_type::MaxVal ), "response type is out of range" );
+      api_template_table templates( get_self(), get_self().value );
+      for (const auto& [id, delta]: template_refs) {
+         if (delta == 0) {
+            continue;
+         }
+         const auto& t = templates.get( id, "api template is missing" );
+         check( delta > 0 || t.refcount >= static_cast<uint64_t>(-delta), "api template refcount underflow" );
+         templates.modify( t, same_payer, [&, d=delta]( auto& row ) {
+            row.refcount += d;
+         });
+      }
    }
 
-   std::pair<name, name> system_contract::get_current_oracle() const
+   /**
+    *  Handles up to max_rows requests that timed out in both timeframes as an empty reply would,
+    *  without notifying their callers. Callers are walked round robin from where the previous sweep
+    *  stopped, at most max_rows of them, and callers without open requests are erased. RAM of the
+    *  erased rows is recorded in the reqsweep singleton.
+    *
+    *  @return number of requests erased
+    */
+   uint16_t system_contract::sweep_expired_requests( uint16_t max_rows )
+   {
+      const uint128_t expired_before = uint128_t( (current_time_point() - request_period - request_period).time_since_epoch().count() + 1 ) << 64;
+      request_caller_table callers( get_self(), get_self().value );
+      request_sweep_singleton sweep_table( get_self(), get_self().value );
+      auto sweep = sweep_table.get_or_default();
+      const name first_caller = sweep.next_caller;
+
+      oracle_deltas_map oracle_deltas;
+      template_refs_map template_refs;
+      uint16_t rows = 0;
+      uint64_t ram_bytes = 0;
+      uint16_t visited = 0;
+      auto caller_it = callers.lower_bound( sweep.next_caller.value );
+      for (; visited < max_rows && rows < max_rows && !callers.empty(); ++visited) {
+         if (caller_it == callers.end()) {
+            caller_it = callers.begin();
+         }
+         request_info_table requests( get_self(), caller_it->caller.value );
+         auto idx = requests.get_index<"bytime"_n>();
+         request_aggregate_table aggregates( get_self(), caller_it->caller.value );
+         for (auto it = idx.begin(); it != idx.end() && rows < max_rows && it->by_time() < expired_before; ++rows) {
+            const uint64_t request_id = it->id;
+            ram_bytes += row_ram_overhead + pack_size( *it ) + index128_ram_overhead;
+            const auto aggregate = aggregates.find( request_id );
+            if (aggregate != aggregates.end()) {
+               ram_bytes += row_ram_overhead + pack_size( *aggregate );
+            }
+            ++it; // the request is erased by process_reply
+            process_reply( requests, request_id, std::vector<char>(), oracle_deltas, template_refs );
+         }
+         if (requests.begin() == requests.end()) {
+            ram_bytes += row_ram_overhead + pack_size( *caller_it );
+            caller_it = callers.erase( caller_it );
+         }
+         else if (rows < max_rows) {
+            ++caller_it;
+         }
+      }
+      sweep.next_caller = caller_it != callers.end() ? caller_it->caller : name();
+      if (rows > 0) {
+         apply_oracle_deltas( oracle_deltas );
+         apply_template_refs( template_refs );
+         sweep.last_sweep       = current_time_point();
+         sweep.last_rows        = rows;
+         sweep.last_ram_bytes   = ram_bytes;
+         sweep.total_rows      += rows;
+         sweep.total_ram_bytes += ram_bytes;
+      }
+      else if (ram_bytes > 0) { // only rows of callers without requests were erased
+         sweep.total_ram_bytes += ram_bytes;
+      }
+      if (ram_bytes > 0 || sweep.next_caller != first_caller) {
+         sweep_table.set( sweep, get_self() );
+      }
+
+      return rows;
+   }
+
+   /**
+    *  Writes accumulated counter changes, one modify per oracle. Oracles that are not
+    *  registered anymore are skipped.
+    */
+   void system_contract::apply_oracle_deltas( const oracle_deltas_map& oracle_deltas )
+   {
+      uint64_t successful = 0;
+      auto idx = _oracles.get_index<"oracleacc"_n>();
+      for (const auto& [oracle, delta]: oracle_deltas) {
+         auto it = idx.find(oracle.value);
+         if (it == idx.end()) {
+            continue;
+         }
+         idx.modify(it, same_payer, [&, d=delta](auto& o) {
+            o.pending_requests    += d.pending_requests;
+            o.successful_requests += d.successful_requests;
+            o.failed_requests     += d.failed_requests;
+         });
+         successful += delta.successful_requests;
+      }
+
+      if (successful > 0) {
+         check( _oracle_state->total_successful_requests <= std::numeric_limits<decltype(_oracle_state->total_successful_requests)>::max() - successful,
+            "total_successful_requests overflow" );
+         _oracle_state->total_successful_requests += successful;
+      }
+   }
+
+   /**
+    *  Builds the oracle roster of producers, expected in the order of their total votes. Producers
+    *  may set the same oracle account, it is listed once so that selected oracles are different parties.
+    */
+   oracle_roster system_contract::build_oracle_roster( const std::vector<name>& producers ) const
    {
-      auto idx = _producers.get_index<"prototalvote"_n>();
       std::vector<std::pair<name, uint32_t>> active_oracles; // oracle name and it`s pending requests counter
-      for ( auto it = idx.cbegin(); it != idx.cend() && std::distance(idx.cbegin(), it) < 21 && 0 < it->total_votes && it->active(); ++it ) {
-         auto oracle_it = _oracles.find(it->owner.value);
-         if (oracle_it != _oracles.end() && oracle_it->is_active()) {
-            active_oracles.emplace_back(oracle_it->oracle_account, oracle_it->pending_requests);
+      for ( const auto& producer : producers ) {
+         auto oracle_it = _oracles.find(producer.value);
+         if (oracle_it == _oracles.end() || !oracle_it->is_active()) {
+            continue;
+         }
+         const auto account = oracle_it->oracle_account;
+         const bool listed = std::any_of( active_oracles.begin(), active_oracles.end(),
+                                          [&]( const std::pair<name, uint32_t>& o ) { return o.first == account; } );
+         if (!listed) {
+            active_oracles.emplace_back(account, oracle_it->pending_requests);
          }
       }
-      check( !active_oracles.empty(), "noone from top21 has active oracle" );
       //sort oracles by pending requests in descending order
       std::sort( active_oracles.begin(), active_oracles.end(),
                  [](const std::pair<name, uint32_t>& l, const std::pair<name, uint32_t>& r) { return l.second > r.second; } );
 
-      //Calculate oracle based on current block time and number of pending requests
+      oracle_roster roster;
+      roster.producers = producers;
+      if (active_oracles.empty()) {
+         return roster;
+      }
+
+      //Calculate probability ranges based on number of pending requests
       uint32_t value = 10; //the higher value the higher probability for oracle
       uint32_t total = value;
-      std::vector<uint32_t> v{ total }; // vector of increasing values (probability ranges).
-      // v { 10, 20, 30 } means that first oracle has probability range [0, 10), second - [10, 20), third - [20, 30)
-      // so if seed value x is in range [0, 10) than the first oracle choosen, [10, 20) - second, [20, 30) - third
+      roster.oracles.push_back(active_oracles[0].first);
+      roster.weights.push_back(total);
+      // weights { 10, 20, 30 } means that first oracle has probability range [0, 10), second - [10, 20), third - [20, 30)
       for (size_t i = 1; i < active_oracles.size(); i++) {
          if (active_oracles[i - 1].second > active_oracles[i].second) {
             value++; //increase probability if oracle has less pending requests than previous one
          }
          total += value;
-         v.push_back(total);
+         roster.oracles.push_back(active_oracles[i].first);
+         roster.weights.push_back(total);
+      }
+      return roster;
+   }
+
+   void system_contract::refresh_oracle_roster( const std::vector<name>& producers )
+   {
+      oracle_roster_singleton roster_table( get_self(), get_self().value );
+      roster_table.get_tracked_or_default();
+      roster_table.set_if_changed( build_oracle_roster( producers ), get_self() );
+   }
+
+   oracle_roster system_contract::current_oracle_roster() const
+   {
+      oracle_roster_singleton roster_table( get_self(), get_self().value );
+      if (roster_table.exists()) {
+         return roster_table.get();
+      }
+      // roster is built by the first producer schedule update, until then use the current top 21
+      std::vector<name> producers;
+      auto idx = _producers.get_index<"prototalvote"_n>();
+      for ( auto it = idx.cbegin(); it != idx.cend() && producers.size() < 21 && 0 < it->total_votes && it->active(); ++it ) {
+         producers.push_back(it->owner);
       }
+      return build_oracle_roster(producers);
+   }
+
+   std::pair<name, name> system_contract::get_current_oracle() const
+   {
+      auto roster = current_oracle_roster();
+      check( !roster.oracles.empty(), "noone from top21 has active oracle" );
 
+      // seed value x selects the oracle whose range [weights[i-1], weights[i]) contains it
+      auto& v = roster.weights;
+      uint32_t total = v.back();
       std::pair<name, name> ret;
       auto x = current_block_time().slot % total;
-      auto it = std::find_if(std::begin(v), std::end(v), [x](const auto& val) { return x < val; });
+      auto it = std::upper_bound(std::begin(v), std::end(v), x);
       check( it != std::end(v), "shouldn`t happen" );
       auto index = std::distance(std::begin(v), it);
-      ret.first = active_oracles[index].first;
+      ret.first = roster.oracles[index];
 
       // delete choosen oracle because standby oracle must be a different one
       if (index == 0) {
-         total -= 10;
+         total -= v[0];
       }
       else {
          total -= (v[index] - v[index - 1]);
       }
       v.erase(it);
-      active_oracles.erase(active_oracles.begin() + index);
-      if (!active_oracles.empty()) {
+      roster.oracles.erase(roster.oracles.begin() + index);
+      if (!roster.oracles.empty()) {
          x = current_block_time().slot % total;
-         it = std::find_if(std::begin(v), std::end(v), [x](const auto& val) { return x < val; });
+         it = std::upper_bound(std::begin(v), std::end(v), x);
          check( it != std::end(v), "shouldn`t happen" );
          index = std::distance(std::begin(v), it);
-         ret.second = active_oracles[index].first;
+         ret.second = roster.oracles[index];
       }
       return ret;
    }
-} //namespace eosiosystem
\ No newline at end of file
+
+   /**
+    *  Selects count different oracles of the roster, each one with a chance proportional to its
+    *  weight among the oracles that are not selected yet.
+    */
+   std::vector<name> system_contract::select_oracles( uint8_t count ) const
+   {
+      check( count <= max_aggregate_oracles, "oracle count is too large" );
+      auto roster = current_oracle_roster();
+      check( roster.oracles.size() >= count, "not enough active oracles in top21" );
+
+      std::vector<uint32_t> weights( roster.weights.size() );
+      for (size_t i = 0; i < weights.size(); i++) {
+         weights[i] = roster.weights[i] - (i == 0 ? 0 : roster.weights[i - 1]);
+      }
+      uint32_t total = roster.weights.back();
+
+      std::vector<name> selected;
+      uint64_t seed = current_block_time().slot;
+      while (selected.size() < count) {
+         uint32_t x = seed % total;
+         size_t index = 0;
+         while (x >= weights[index]) {
+            x -= weights[index];
+            index++;
+         }
+         selected.push_back(roster.oracles[index]);
+
+         total -= weights[index];
+         weights.erase(weights.begin() + index);
+         roster.oracles.erase(roster.oracles.begin() + index);
+         seed = seed * 6364136223846793005ull + 1442695040888963407ull; // next value of a linear congruential sequence
+      }
+      return selected;
+   }
+} //namespace eosiosystem
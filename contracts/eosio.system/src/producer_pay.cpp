@@ -3,6 +3,8 @@
 #include <eosio.token/eosio.token.hpp>
 #include <dapp_registry/dapp_registry.hpp>
 
+#include <algorithm>
+
 namespace eosiosystem {
 
    // const int64_t  min_pervote_daily_pay         = 100'0000;
@@ -10,24 +12,13 @@ namespace eosiosystem {
    // const int64_t  min_activated_stake           = 120'000'000'0000;
    const int64_t  min_activated_stake           = 10'000'000'0000;
    const double   continuous_rate               = 0.04879;          // 5% annual rate
-   // TODO move those constants into _gstate to make them configurable
-   // Network rewards
-   const double   network_rewards_rate          = 0.5;              // 50% of new tokens
-   const double   dapps_rewards_rate            = 0.2;              // 20% of network rewards
-   const double   bp_rewards_rate               = 0.6;              // 60% of network rewards
-   const double   witnesses_rewards_rate        = 0.15;             // 15% of network rewards
-   const double   vote_rewards_rate             = 0.05;             // 05% of network rewards 
-
-   // Infrastructure rewards
-   const double   infrastructure_rewards_rate   = 0.5;              // 50% of new tokens
-   const double   community_rewards_rate        = 0.65;             // 65% of infrastructure rewards
-   const double   marketing_rewards_rate        = 0.1;              // 10% of infrastructure rewards
-   const double   founding_rewards_rate         = 0.25;             // 25% of infrastrcuture rewards
+   // Split of new tokens between funds and buckets is kept in the rewardrates singleton, see reward_rates
 
    // Oracle rewards
-   const double   oracle_rewards_rate           = 0.02;             // 2% of Community rewards
    constexpr int64_t oracle_punishment_rate     = 1'0000;           // number of tokens per failed request
 
+   const uint32_t max_claim_batch_size          = 50;               // producers paid by one claimall
+
    const uint32_t blocks_per_year               = 52*7*24*2*3600;   // half seconds per year
    const uint32_t seconds_per_year              = 52*7*24*3600;
    const uint32_t blocks_per_day                = 2 * 24 * 3600;
@@ -36,6 +27,13 @@ namespace eosiosystem {
    const int64_t  useconds_per_year             = seconds_per_year*1000000ll;
 
 
+   /**
+    *  Returns rate_bp basis points of amount, rounded down.
+    */
+   static int64_t share_of( int64_t amount, uint16_t rate_bp ) {
+      return static_cast<int64_t>( (int128_t(amount) * rate_bp) / rate_basis_points );
+   }
+
    void system_contract::onblock( ignore<block_header> ) {
       using namespace eosio;
 
@@ -43,50 +41,62 @@ namespace eosiosystem {
 
       block_timestamp timestamp;
       name producer;
-      _ds >> timestamp >> producer;
+      uint16_t confirmed;
+      capi_checksum256 previous;
+      _ds >> timestamp >> producer >> confirmed >> previous;
+      // a block id starts with the big endian block number
+      const uint32_t block_num = ( (uint32_t(previous.hash[0]) << 24) | (uint32_t(previous.hash[1]) << 16)
+                                 | (uint32_t(previous.hash[2]) << 8) | uint32_t(previous.hash[3]) ) + 1;
 
       // _gstate2.last_block_num is not used anywhere in the system contract code anymore.
       // Although this field is deprecated, we will continue updating it for now until the last_block_num field
       // is eventually completely removed, at which point this line can be removed.
-      _gstate2.last_block_num = timestamp;
+      _gstate2->last_block_num = timestamp;
 
       /** until activated stake crosses this threshold no new rewards are paid */
-      if( _gstate.total_activated_stake < min_activated_stake )
+      if( _gcounters->total_activated_stake < min_activated_stake )
          return;
 
-      if( _gstate.last_pervote_bucket_fill == time_point() )  /// start the presses
-         _gstate.last_pervote_bucket_fill = current_time_point();
+      if( _gcounters->last_pervote_bucket_fill == time_point() )  /// start the presses
+         _gcounters->last_pervote_bucket_fill = current_time_point();
 
-      if( _gstate.last_dapp_bucket_fill == time_point() )
-         _gstate.last_dapp_bucket_fill = current_time_point();
+      if( _gcounters->last_dapp_bucket_fill == time_point() )
+         _gcounters->last_dapp_bucket_fill = current_time_point();
 
       /**
-       * At startup the initial producer may not be one that is registered / elected
-       * and therefore there may be no producer object for them.
+       * Produced blocks are counted in the unpaidblocks singleton and moved into producer rows
+       * by flush_unpaid_blocks, so that a block does not rewrite the producer row. The singleton
+       * itself is written once per run of blocks of a producer and once per schedule update.
        */
-      auto prod = _producers.find( producer.value );
-      if ( prod != _producers.end() ) {
-         _gstate.total_unpaid_blocks++;
-         _producers.modify( prod, same_payer, [&](auto& p ) {
-               p.unpaid_blocks++;
-         });
+      unpaid_blocks_singleton unpaid_table( _self, _self.value );
+      auto unpaid = unpaid_table.get_or_default();
+      bool unpaid_changed = false;
+      if( producer != unpaid.current_producer ) {
+         unpaid.count_current_run( block_num );
+         unpaid.current_producer    = producer;
+         unpaid.current_first_block = block_num;
+         unpaid_changed = true;
       }
 
       /// only update block producers once every minute, block_timestamp is in half seconds
-      if( timestamp.slot - _gstate.last_producer_schedule_update.slot > 120 ) {
+      if( timestamp.slot - _gcounters->last_producer_schedule_update.slot > 120 ) {
+         unpaid.count_current_run( block_num + 1 );
+         flush_unpaid_blocks( unpaid );
+         unpaid_changed = true;
          update_elected_producers( timestamp );
+         schedule_maintenance();
 
-         if( (timestamp.slot - _gstate.last_name_close.slot) > blocks_per_day ) {
+         if( (timestamp.slot - _gcounters->last_name_close.slot) > blocks_per_day ) {
             name_bid_table bids(_self, _self.value);
             auto idx = bids.get_index<"highbid"_n>();
             auto highest = idx.lower_bound( std::numeric_limits<uint64_t>::max()/2 );
             if( highest != idx.end() &&
                 highest->high_bid > 0 &&
                 (current_time_point() - highest->last_bid_time) > microseconds(useconds_per_day) &&
-                _gstate.thresh_activated_stake_time > time_point() &&
-                (current_time_point() - _gstate.thresh_activated_stake_time) > microseconds(14 * useconds_per_day)
+                _gstate->thresh_activated_stake_time > time_point() &&
+                (current_time_point() - _gstate->thresh_activated_stake_time) > microseconds(14 * useconds_per_day)
             ) {
-               _gstate.last_name_close = timestamp;
+               _gcounters->last_name_close = timestamp;
                channel_namebid_to_rex( highest->high_bid );
                idx.modify( highest, same_payer, [&]( auto& b ){
                   b.high_bid = -b.high_bid;
@@ -94,293 +104,210 @@ namespace eosiosystem {
             }
          }
       }
-   }
-
-   using namespace eosio;
-   void system_contract::claimrewards( const name owner ) {
-      require_auth( owner );
-      name producer;
-      check( _gstate.total_activated_stake >= min_activated_stake, "cannot claim rewards until the chain is activated (at least 15% of all tokens participate in voting)" );
-      
-      // share inflation between buckets
-      share_inflation();
-
-      // pay rewards for producing blocks
-      const auto& prod = _producers.get( owner.value );
-      check( prod.active(), "producer does not have an active key" );
-
-      const auto ct = current_time_point();
-      // check( ct - prod.last_claim_time > microseconds(useconds_per_day), "already claimed rewards within past day" );
-
-      auto prod2 = _producers2.find( owner.value );
-
-      /// New metric to be used in pervote pay calculation. Instead of vote weight ratio, we combine vote weight and
-      /// time duration the vote weight has been held into one metric.
-      const auto last_claim_plus_3days = prod.last_claim_time + microseconds(3 * useconds_per_day);
-
-      bool crossed_threshold       = (last_claim_plus_3days <= ct);
-      bool updated_after_threshold = true;
-      if ( prod2 != _producers2.end() ) {
-         updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-      } else {
-         prod2 = _producers2.emplace( owner, [&]( producer_info2& info  ) {
-            info.owner                     = owner;
-            info.last_votepay_share_update = ct;
-         });
-      }
 
-      // Note: updated_after_threshold implies cross_threshold (except if claiming rewards when the producers2 table row did not exist).
-      // The exception leads to updated_after_threshold to be treated as true regardless of whether the threshold was crossed.
-      // This is okay because in this case the producer will not get paid anything either way.
-      // In fact it is desired behavior because the producers votes need to be counted in the global total_producer_votepay_share for the first time.
-
-      // Block Reward with filling buckets 
-      int64_t producer_per_block_pay = 0;
-      if( _gstate.total_unpaid_blocks > 0 ) {
-         producer_per_block_pay = (_gstate.perblock_bucket * prod.unpaid_blocks) / _gstate.total_unpaid_blocks;
-         print("_gstate.perblock_bucket =",_gstate.perblock_bucket);
-         print("prod.unpaid_blocks =",prod.unpaid_blocks);
-         print("_gstate.total_unpaid_blocks =",_gstate.total_unpaid_blocks);
+      if( unpaid_changed ) {
+         unpaid_table.set( unpaid, _self );
       }
+   }
 
-      // Block Reward with constant bucket values
-      // int64_t producer_per_block_pay = 0;
-      // int64_t perblock_bucket_share = 0;
-      // if( _gstate.total_unpaid_blocks > 0 ) {
-      //    perblock_bucket_share = _gstate.perblock_bucket / 365;
-      //    producer_per_block_pay = (perblock_bucket_share * prod.unpaid_blocks) / _gstate.total_unpaid_blocks;
-      //    print("_gstate.perblock_bucket =",_gstate.perblock_bucket);
-      //    print("perblock_bucket_share =",perblock_bucket_share);
-      //    print("prod.unpaid_blocks =",prod.unpaid_blocks);
-      //    print("_gstate.total_unpaid_blocks =",_gstate.total_unpaid_blocks);
-      // }
-
-      double new_votepay_share = update_producer_votepay_share( prod2, ct, updated_after_threshold ? 0.0 : prod.total_votes, true); // reset votepay_share to zero after updating
-
-      // Witness Reward with filling buckets
-      int64_t producer_per_witness_pay = 0;
-      auto idx = _producers.get_index<"prototalvote"_n>();
-      const auto prod_it_by_votes = idx.find( owner.value );
-      const auto position = std::distance( idx.begin(), prod_it_by_votes );
-      bool is_witness = position < 50 && (prod_it_by_votes->total_votes / _gstate.total_producer_vote_weight) > 0.005;
-      const auto prod3_it = _producers3.find( owner.value );
-      check( prod3_it != _producers3.end(),"producer not found");
-      double new_witness_share = update_producer_witnesspay_share( prod3_it, ct, (is_witness ? 1.0 : 0.0), true);
-      double total_witness_share = update_total_witnesspay_share( ct );
-      print("total_witness_share =",total_witness_share);
-      if( total_witness_share > 0 ) {
-         producer_per_witness_pay = int64_t((new_witness_share * _gstate.perwitness_bucket) / total_witness_share);
-         if( producer_per_witness_pay > _gstate.perwitness_bucket ){
-            print("producer_per_witness_pay =",producer_per_witness_pay);
-            print("new_witness_share =",new_witness_share);
-            print("_gstate.perwitness_bucket =",_gstate.perwitness_bucket);
-            print("total_witness_share =",total_witness_share);
-            producer_per_witness_pay = _gstate.perwitness_bucket;
-            
-         }
-      }
-
-      // Witness Reward with constant bucket values
-      // int64_t producer_per_witness_pay = 0;
-      // int64_t perwitness_bucket_share = 0;
-      // auto idx = _producers.get_index<"prototalvote"_n>();
-      // const auto prod_it_by_votes = idx.find( owner.value );
-      // const auto position = std::distance( idx.begin(), prod_it_by_votes );
-      // bool is_witness = position < 50 && (prod_it_by_votes->total_votes / _gstate.total_producer_vote_weight) > 0.005;
-      // const auto prod3_it = _producers3.find( owner.value );
-      // check( prod3_it != _producers3.end(),"producer not found");
-      // double new_witness_share = update_producer_witnesspay_share( prod3_it, ct, (is_witness ? 1.0 : 0.0), true);
-      // double total_witness_share = update_total_witnesspay_share( ct );
-      // print("total_witness_share =",total_witness_share);
-      // if( total_witness_share > 0 ) {
-      //    perwitness_bucket_share = _gstate.perwitness_bucket / 365;
-      //    producer_per_witness_pay = int64_t((new_witness_share * perwitness_bucket_share) / total_witness_share);
-      //    if( producer_per_witness_pay > perwitness_bucket_share ){
-      //       print("")
-      //       print("new_witness_share =",new_witness_share);
-      //       print("_gstate.perwitness_bucket =",_gstate.perwitness_bucket);
-      //       print("total_witness_share =",total_witness_share);
-      //       producer_per_witness_pay = perwitness_bucket_share;
-            
-      //    }
-      // }
-      update_total_witnesspay_share( ct, -new_witness_share, (is_witness ? 1.0 : 0.0) );
-
-
-      // Oracle Reward with filling buckets
-      int64_t producer_oracle_pay = 0;
-      const auto oracle_it = _oracles.find( owner.value );
-      if (oracle_it != _oracles.end()) {
-         if( _oracle_state.total_successful_requests > 0 ) {
-            print("_gstate.oracle_bucket =",_gstate.oracle_bucket);
-            print("oracle_it->successful_requests =",oracle_it->successful_requests);
-            print("_oracle_state.total_successful_requests =",_oracle_state.total_successful_requests);
-            producer_oracle_pay = int64_t((_gstate.oracle_bucket * oracle_it->successful_requests ) / _oracle_state.total_successful_requests);
-         }
-
-         int64_t punishment = oracle_it->pending_punishment + (oracle_it->failed_requests * oracle_punishment_rate);
-         print("oracle_it->pending_punishment =",oracle_it->pending_punishment);
-         print("oracle_it->failed_requests =",oracle_it->failed_requests);
-         print("oracle_punishment_rate",oracle_punishment_rate);
-         const auto oracle_pay_punishment = std::min(producer_oracle_pay, punishment);
-         producer_oracle_pay -= oracle_pay_punishment;
-         punishment -= oracle_pay_punishment;
-         if (punishment > 0) {
-            const auto per_block_pay_punishment = std::min(producer_per_block_pay, punishment);
-            producer_per_block_pay -= per_block_pay_punishment;
-            punishment -= per_block_pay_punishment;
+   /**
+    *  Moves the block counts accumulated by onblock into producer rows and total_unpaid_blocks.
+    *  At startup the initial producer may not be one that is registered / elected and therefore
+    *  there may be no producer object for them, blocks of such producers are not paid.
+    */
+   void system_contract::flush_unpaid_blocks( unpaid_blocks_state& unpaid ) {
+      for( const auto& c : unpaid.producers ) {
+         auto prod = _producers.find( c.producer.value );
+         if( prod == _producers.end() ) {
+            continue;
          }
-
-         _oracle_state.total_successful_requests -= oracle_it->successful_requests;
-         _oracles.modify(oracle_it, same_payer, [&](auto& o) {
-            o.successful_requests = 0;
-            o.failed_requests     = 0;
-            o.pending_punishment += punishment;
+         _gcounters->total_unpaid_blocks += c.blocks;
+         _producers.modify( prod, same_payer, [&](auto& p ) {
+            p.unpaid_blocks += c.blocks;
          });
       }
+      unpaid.producers.clear();
+   }
 
-      _gstate.perwitness_bucket           -= producer_per_witness_pay;
-      _gstate.perblock_bucket             -= producer_per_block_pay;
-      _gstate.total_unpaid_blocks         -= prod.unpaid_blocks;
-      _gstate.oracle_bucket               -= producer_oracle_pay;
-
-      update_total_votepay_share( ct, -new_votepay_share, (updated_after_threshold ? prod.total_votes : 0.0) );
-      _producers.modify( prod, same_payer, [&](auto& p) {
-         p.last_claim_time       = ct;
-         p.unpaid_blocks         = 0;
-         // p.unpaid_witness_reward = 0;
-      });
+   using namespace eosio;
+   void system_contract::claimrewards( const name owner ) {
+      require_auth( owner );
+      claim_producer_rewards( { owner } );
+   }
 
-      // Sharing bpay reward
-      if( producer_per_block_pay > 0 ) {
-         INLINE_ACTION_SENDER(eosio::token, transfer)(
-            token_account, { {bpay_account, active_permission}, {owner, active_permission} },
-            { bpay_account, owner, asset(producer_per_block_pay, core_symbol()), std::string("producer block pay") }
-         );
-      }
-      // Sharing wpay reward
-      if( producer_per_witness_pay > 0 ) {
-         INLINE_ACTION_SENDER(eosio::token, transfer)(
-            token_account, { {wpay_account, active_permission}, {owner, active_permission} },
-            { wpay_account, owner, asset(producer_per_witness_pay, core_symbol()), std::string("producer witness pay") }
-         );
+   void system_contract::claimall( const std::vector<name>& owners ) {
+      check( !owners.empty(), "no producers specified" );
+      check( owners.size() <= max_claim_batch_size, "attempt to claim rewards for too many producers" );
+      for( size_t i = 1; i < owners.size(); ++i ) {
+         check( owners[i-1] < owners[i], "producers must be unique and sorted" );
       }
-      // Sharing oracle reward
-      if( producer_oracle_pay > 0 ) {
-         INLINE_ACTION_SENDER(eosio::token, transfer)(
-            token_account, { {oracle_account, active_permission}, {owner, active_permission} },
-            { oracle_account, owner, asset(producer_oracle_pay, core_symbol()), std::string("producer oracle pay") }
-         );
+      for( const auto& owner : owners ) {
+         require_auth( owner );
       }
-
-
+      claim_producer_rewards( owners );
    }
 
-   void system_contract::claimdapprwd( const name dapp_registry, const name owner, const name dapp ) {
-      require_auth( owner );
-
-      check( _gstate.total_activated_stake >= min_activated_stake, "cannot claim rewards until the chain is activated (at least 15% of all tokens participate in voting)" );
+   /**
+    *  Pays block, witness and oracle rewards to owners. Every producer is paid from the buckets and
+    *  totals as they were before the first payment, which is what sequential claims in the same block
+    *  would pay, and the global share totals are updated once for all of them.
+    */
+   void system_contract::claim_producer_rewards( const std::vector<name>& owners ) {
+      check( _gcounters->total_activated_stake >= min_activated_stake, "cannot claim rewards until the chain is activated (at least 15% of all tokens participate in voting)" );
 
       // share inflation between buckets
-      // share_inflation();
-      const auto ct = current_time_point();
-      // const auto usecs_since_last_fill = (ct - _gstate.last_pervote_bucket_fill).count();
-      const auto usecs_since_last_fill = (ct - _gstate.last_dapp_bucket_fill).count();
+      share_inflation();
 
-      // check if we filled bucked in last second
-      // if( usecs_since_last_fill <= 0 || _gstate.last_pervote_bucket_fill <= time_point() ) {
-         if( usecs_since_last_fill <= 0 || _gstate.last_dapp_bucket_fill <= time_point() ) {
-         return;
+      // account blocks produced since the last schedule update, blocks of the current run of a producer
+      // are accounted by the next schedule update
+      unpaid_blocks_singleton unpaid_table( _self, _self.value );
+      if( unpaid_table.exists() ) {
+         auto unpaid = unpaid_table.get();
+         if( !unpaid.producers.empty() ) {
+            flush_unpaid_blocks( unpaid );
+            unpaid_table.set( unpaid, _self );
+         }
       }
 
-      const asset token_supply   = eosio::token::get_supply(token_account, core_symbol().code() );
-      const auto new_tokens = static_cast<int64_t>( (continuous_rate * double(token_supply.amount) * double(usecs_since_last_fill)) / double(useconds_per_year) );
-
-      const auto network_rewards          = network_rewards_rate * new_tokens;
-      const auto infrastructure_rewards   = infrastructure_rewards_rate * new_tokens;
-
-      const auto to_producers             = bp_rewards_rate * network_rewards;
-
-      const auto to_dapps                 = dapps_rewards_rate * network_rewards;
-      const auto to_witnesses             = witnesses_rewards_rate * network_rewards;
-      const auto to_voters                = vote_rewards_rate * network_rewards;
-      
-      const auto to_community             = community_rewards_rate * infrastructure_rewards;
-      const auto to_marketing             = marketing_rewards_rate * infrastructure_rewards;
-      const auto to_founding              = founding_rewards_rate * infrastructure_rewards;
-
-      const auto to_oracle                = oracle_rewards_rate * to_community;
-
-      INLINE_ACTION_SENDER(eosio::token, issue)(
-         token_account, { {_self, active_permission} },
-         { _self, asset(new_tokens, core_symbol()), std::string("issue tokens for producer pay and savings") }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {_self, active_permission} },
-         { _self, network_account, asset(network_rewards, core_symbol()), "For Network" }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {_self, active_permission} },
-         { _self, infrastructure_account, asset(infrastructure_rewards, core_symbol()), "For Infrastructure" }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {infrastructure_account, active_permission} },
-         { infrastructure_account, community_account, asset(to_community, core_symbol()), "For community fund" }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {infrastructure_account, active_permission} },
-         { infrastructure_account, marketing_account, asset(to_marketing, core_symbol()), "For marketing fund" }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {infrastructure_account, active_permission} },
-         { infrastructure_account, founding_account, asset(to_founding, core_symbol()), "For founding fund" }
-      );
-
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {community_account, active_permission} },
-         { community_account, oracle_account, asset(to_oracle, core_symbol()), "For oracle fund" }
-      );
+      const auto ct = current_time_point();
+      const auto witnesses = get_current_witnesses();
+      const double total_witness_share = update_total_witnesspay_share( ct );
+
+      const int64_t  perblock_bucket           = _gcounters->perblock_bucket;
+      const uint32_t total_unpaid_blocks       = _gcounters->total_unpaid_blocks;
+      const int64_t  perwitness_bucket         = _gcounters->perwitness_bucket;
+      const int64_t  oracle_bucket             = _gcounters->oracle_bucket;
+      const auto     total_successful_requests = _oracle_state->total_successful_requests;
+
+      double votepay_share_delta    = 0.0;
+      double votepay_rate_delta     = 0.0;
+      double witnesspay_share_delta = 0.0;
+      double witnesspay_rate_delta  = 0.0;
+
+      for( const auto& owner : owners ) {
+         // pay rewards for producing blocks
+         const auto& prod = _producers.get( owner.value );
+         check( prod.active(), "producer does not have an active key" );
+
+         // check( ct - prod.last_claim_time > microseconds(useconds_per_day), "already claimed rewards within past day" );
+
+         auto prod_pay = find_producer_pay( owner );
+
+         /// New metric to be used in pervote pay calculation. Instead of vote weight ratio, we combine vote weight and
+         /// time duration the vote weight has been held into one metric.
+         const auto last_claim_plus_3days = prod.last_claim_time + microseconds(3 * useconds_per_day);
+
+         bool crossed_threshold       = (last_claim_plus_3days <= ct);
+         bool updated_after_threshold = true;
+         if ( prod_pay != _producerpay.end() ) {
+            updated_after_threshold = (last_claim_plus_3days <= prod_pay->last_votepay_share_update);
+         } else {
+            prod_pay = _producerpay.emplace( owner, [&]( producer_pay_info& info  ) {
+               info.owner                        = owner;
+               info.last_votepay_share_update    = ct;
+               info.last_witnesspay_share_update = ct;
+            });
+         }
 
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {network_account, active_permission} },
-         { network_account, bpay_account, asset(to_producers, core_symbol()), "For Block Producers fund" }
-      );
+         // Note: updated_after_threshold implies cross_threshold (except if claiming rewards when the producerpay table row did not exist).
+         // The exception leads to updated_after_threshold to be treated as true regardless of whether the threshold was crossed.
+         // This is okay because in this case the producer will not get paid anything either way.
+         // In fact it is desired behavior because the producers votes need to be counted in the global total_producer_votepay_share for the first time.
 
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {network_account, active_permission} },
-         { network_account, dpay_account, asset(to_dapps, core_symbol()), "For DApp-Developers fund" }
-      );
+         // Block Reward with filling buckets
+         int64_t producer_per_block_pay = 0;
+         if( total_unpaid_blocks > 0 ) {
+            producer_per_block_pay = (perblock_bucket * prod.unpaid_blocks) / total_unpaid_blocks;
+         }
 
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {network_account, active_permission} },
-         { network_account, wpay_account, asset(to_witnesses, core_symbol()), "For Witnesses fund" }
-      );
+         double new_votepay_share = update_producer_votepay_share( prod_pay, ct, updated_after_threshold ? 0.0 : prod.total_votes, true); // reset votepay_share to zero after updating
 
-      INLINE_ACTION_SENDER(eosio::token, transfer)(
-         token_account, { {network_account, active_permission} },
-         { network_account, vpay_account, asset(to_voters, core_symbol()), "For Voters fund" }
-      );
+         // Witness Reward with filling buckets
+         int64_t producer_per_witness_pay = 0;
+         const bool is_witness = std::binary_search( witnesses.begin(), witnesses.end(), owner );
+         double new_witness_share = update_producer_witnesspay_share( prod_pay, ct, (is_witness ? 1.0 : 0.0), true);
+         if( total_witness_share > 0 ) {
+            producer_per_witness_pay = int64_t((new_witness_share * perwitness_bucket) / total_witness_share);
+            if( producer_per_witness_pay > perwitness_bucket ) {
+               producer_per_witness_pay = perwitness_bucket;
+            }
+         }
+         witnesspay_share_delta -= new_witness_share;
+         witnesspay_rate_delta  += (is_witness ? 1.0 : 0.0);
+
+         // Oracle Reward with filling buckets
+         int64_t producer_oracle_pay = 0;
+         const auto oracle_it = _oracles.find( owner.value );
+         if (oracle_it != _oracles.end()) {
+            if( total_successful_requests > 0 ) {
+               producer_oracle_pay = int64_t((oracle_bucket * oracle_it->successful_requests ) / total_successful_requests);
+            }
 
-      _gstate.perblock_bucket                       += to_producers;
-      _gstate.dapps_per_transfer_rewards_bucket     += 0.5 * to_dapps;
-      _gstate.dapps_per_user_rewards_bucket         += 0.5 * to_dapps;
-      _gstate.perwitness_bucket                     += to_witnesses;
-      _gstate.pervote_bucket                        += to_voters;
-      _gstate.oracle_bucket                         += to_oracle;
-      // _gstate.last_pervote_bucket_fill               = ct;
-      _gstate.last_dapp_bucket_fill               = ct;
+            int64_t punishment = oracle_it->pending_punishment + (oracle_it->failed_requests * oracle_punishment_rate);
+            const auto oracle_pay_punishment = std::min(producer_oracle_pay, punishment);
+            producer_oracle_pay -= oracle_pay_punishment;
+            punishment -= oracle_pay_punishment;
+            if (punishment > 0) {
+               const auto per_block_pay_punishment = std::min(producer_per_block_pay, punishment);
+               producer_per_block_pay -= per_block_pay_punishment;
+               punishment -= per_block_pay_punishment;
+            }
 
+            _oracle_state->total_successful_requests -= oracle_it->successful_requests;
+            _oracles.modify(oracle_it, same_payer, [&](auto& o) {
+               o.successful_requests = 0;
+               o.failed_requests     = 0;
+               o.pending_punishment += punishment;
+            });
+         }
 
+         _gcounters->perwitness_bucket           -= producer_per_witness_pay;
+         _gcounters->perblock_bucket             -= producer_per_block_pay;
+         _gcounters->total_unpaid_blocks         -= prod.unpaid_blocks;
+         _gcounters->oracle_bucket               -= producer_oracle_pay;
+
+         votepay_share_delta -= new_votepay_share;
+         votepay_rate_delta  += (updated_after_threshold ? prod.total_votes : 0.0);
+         _producers.modify( prod, same_payer, [&](auto& p) {
+            p.last_claim_time       = ct;
+            p.unpaid_blocks         = 0;
+            // p.unpaid_witness_reward = 0;
+         });
 
+         // Sharing bpay reward
+         if( producer_per_block_pay > 0 ) {
+            INLINE_ACTION_SENDER(eosio::token, transfer)(
+               token_account, { {bpay_account, active_permission}, {owner, active_permission} },
+               { bpay_account, owner, asset(producer_per_block_pay, core_symbol()), std::string("producer block pay") }
+            );
+         }
+         // Sharing wpay reward
+         if( producer_per_witness_pay > 0 ) {
+            INLINE_ACTION_SENDER(eosio::token, transfer)(
+               token_account, { {wpay_account, active_permission}, {owner, active_permission} },
+               { wpay_account, owner, asset(producer_per_witness_pay, core_symbol()), std::string("producer witness pay") }
+            );
+         }
+         // Sharing oracle reward
+         if( producer_oracle_pay > 0 ) {
+            INLINE_ACTION_SENDER(eosio::token, transfer)(
+               token_account, { {oracle_account, active_permission}, {owner, active_permission} },
+               { oracle_account, owner, asset(producer_oracle_pay, core_symbol()), std::string("producer oracle pay") }
+            );
+         }
+      }
 
+      update_total_witnesspay_share( ct, witnesspay_share_delta, witnesspay_rate_delta );
+      update_total_votepay_share( ct, votepay_share_delta, votepay_rate_delta );
+   }
 
+   void system_contract::claimdapprwd( const name dapp_registry, const name owner, const name dapp ) {
+      require_auth( owner );
 
+      check( _gcounters->total_activated_stake >= min_activated_stake, "cannot claim rewards until the chain is activated (at least 15% of all tokens participate in voting)" );
 
+      // share inflation between buckets
+      share_inflation();
 
       // ensure that we have corresponding record owner-app
       const auto dapp_info =  eosio::dapp_registry::get_dapp_info( dapp_registry, owner, dapp );
@@ -393,15 +320,15 @@ namespace eosiosystem {
       switch ( static_cast< eosio::dapp_registry::preference_type >( dapp_info.preference ) )
       {
          case eosio::dapp_registry::preference_type::TokenCirculation:
-            reward = eosio::dapp_registry::get_dapp_rewards( dapp_registry, owner, dapp ) * _gstate.dapps_per_transfer_rewards_bucket;
-            print("_gstate.dapps_per_transfer_rewards_bucket: ",_gstate.dapps_per_transfer_rewards_bucket);
-            _gstate.dapps_per_transfer_rewards_bucket -= reward;
+            reward = eosio::dapp_registry::get_dapp_rewards( dapp_registry, owner, dapp ) * _gcounters->dapps_per_transfer_rewards_bucket;
+            print("_gcounters->dapps_per_transfer_rewards_bucket: ",_gcounters->dapps_per_transfer_rewards_bucket);
+            _gcounters->dapps_per_transfer_rewards_bucket -= reward;
          break;
 
          case eosio::dapp_registry::preference_type::UniqueUsers:
-            reward = eosio::dapp_registry::get_dapp_rewards( dapp_registry, owner, dapp ) * _gstate.dapps_per_user_rewards_bucket;
-            print("_gstate.dapps_per_user_rewards_bucket: ",_gstate.dapps_per_user_rewards_bucket);
-            _gstate.dapps_per_user_rewards_bucket -= reward;
+            reward = eosio::dapp_registry::get_dapp_rewards( dapp_registry, owner, dapp ) * _gcounters->dapps_per_user_rewards_bucket;
+            print("_gcounters->dapps_per_user_rewards_bucket: ",_gcounters->dapps_per_user_rewards_bucket);
+            _gcounters->dapps_per_user_rewards_bucket -= reward;
          break;
       
          default:
@@ -426,12 +353,32 @@ namespace eosiosystem {
 
       const auto& voter = _voters.get( owner.value, "user must stake before they can vote" );
       const auto ct = current_time_point();
-      check( ct - voter.last_claim_time > _gstate.vote_claim_period, "already claimed rewards within past month" );
-      const int64_t reward = voter.unpaid_votes * _gstate.pervote_bucket / _gstate.total_unpaid_votes;
-      print("voter.unpaid_votes =",voter.unpaid_votes);
-      print("_gstate.pervote_bucket =",_gstate.pervote_bucket);
-      print("_gstate.total_unpaid_votes =",_gstate.total_unpaid_votes);
-   
+      check( ct - voter.last_claim_time > _gstate->vote_claim_period, "already claimed rewards within past month" );
+
+      // unpaid_votes were accrued by voteproducer before the voter reward index, they are paid from pervote_bucket
+      int64_t legacy_reward = 0;
+      if( voter.unpaid_votes > 0 && _gcounters->total_unpaid_votes > 0 ) {
+         legacy_reward = int64_t( (int128_t(voter.unpaid_votes) * _gcounters->pervote_bucket) / _gcounters->total_unpaid_votes );
+         print("voter.unpaid_votes =",voter.unpaid_votes);
+         print("_gcounters->pervote_bucket =",_gcounters->pervote_bucket);
+         print("_gcounters->total_unpaid_votes =",_gcounters->total_unpaid_votes);
+      }
+
+      int64_t index_reward = 0;
+      auto pay = _voterpay.find( owner.value );
+      if( pay != _voterpay.end() ) {
+         voter_reward_singleton reward_table( _self, _self.value );
+         auto rewards = reward_table.get_or_default();
+         rewards.advance( ct );
+         reward_table.set( rewards, _self );
+         index_reward = pay->unpaid_rewards + pay->accrued( rewards.reward_per_power );
+         _voterpay.modify( pay, same_payer, [&]( auto& vp ) {
+            vp.unpaid_rewards   = 0;
+            vp.reward_per_power = rewards.reward_per_power;
+         });
+      }
+
+      const int64_t reward = legacy_reward + index_reward;
       check( reward > 0, "no rewards yet");
 
       // make transfer to voter
@@ -442,8 +389,8 @@ namespace eosiosystem {
 
       // deduce paid rewards from voter, total_unpaid rewards and pervote_bucket
       _voters.modify( voter, same_payer, [&]( auto& av ) {
-         _gstate.pervote_bucket     -= reward;
-         _gstate.total_unpaid_votes -= av.unpaid_votes;
+         _gcounters->pervote_bucket     -= legacy_reward;
+         _gcounters->total_unpaid_votes -= av.unpaid_votes;
          av.unpaid_votes             = 0;
          av.last_claim_time          = ct;
       });
@@ -453,35 +400,77 @@ namespace eosiosystem {
    {
       require_auth( get_self() );
       check( period_in_days >= 0, "claim period must be positive" );
-      _gstate.vote_claim_period = eosio::days( period_in_days );
+      _gstate->vote_claim_period = eosio::days( period_in_days );
    }
 
-   void system_contract::share_inflation() {
+   /**
+    *  Accrues inflation since the last bucket fill. Tokens are issued and distributed to the reward
+    *  buckets only once per settlement period, in between the accrued amount is kept in the
+    *  inflation singleton.
+    */
+   void system_contract::share_inflation( bool force_settlement ) {
       const auto ct = current_time_point();
-      const auto usecs_since_last_fill = (ct - _gstate.last_pervote_bucket_fill).count();
+      const auto usecs_since_last_fill = (ct - _gcounters->last_pervote_bucket_fill).count();
+
+      inflation_state_singleton inflation_table( _self, _self.value );
+      auto inflation = inflation_table.get_or_default();
+
+      if( inflation.core_supply == 0 ) {
+         inflation.core_supply = eosio::token::get_supply(token_account, core_symbol().code() ).amount;
+      }
 
       // check if we filled bucked in last second
-      if( usecs_since_last_fill <= 0 || _gstate.last_pervote_bucket_fill <= time_point() ) {
+      if( usecs_since_last_fill > 0 && _gcounters->last_pervote_bucket_fill > time_point() ) {
+         // accrued but not yet issued tokens are part of the supply inflation is computed from. The mirrored
+         // core_supply is exact only right after a settlement, tokens retired or issued by other accounts since
+         // then change the accrual of the rest of the period by continuous_rate of their amount at most
+         const auto supply          = inflation.core_supply + inflation.pending_tokens;
+         const auto new_tokens      = static_cast<int64_t>( (continuous_rate * double(supply) * double(usecs_since_last_fill)) / double(useconds_per_year) );
+
+         inflation.pending_tokens         += new_tokens;
+         _gcounters->last_pervote_bucket_fill  = ct;
+      }
+
+      if( force_settlement || ct - inflation.last_settlement >= inflation.settlement_period ) {
+         // reconcile the mirrored supply with eosio.token stats, it may have changed by retire or
+         // by issues of other accounts; the inline issue of settle_inflation is not applied there yet
+         inflation.core_supply = eosio::token::get_supply(token_account, core_symbol().code() ).amount + inflation.pending_tokens;
+         settle_inflation( inflation.pending_tokens, inflation.settlement_period );
+         inflation.pending_tokens  = 0;
+         inflation.last_settlement = ct;
+      }
+
+      inflation_table.set( inflation, _self );
+   }
+
+   /**
+    *  Issues new_tokens and distributes them between network and infrastructure funds and reward buckets.
+    */
+   void system_contract::settle_inflation( int64_t new_tokens, microseconds period ) {
+      if( new_tokens <= 0 ) {
          return;
       }
 
-      const asset token_supply   = eosio::token::get_supply(token_account, core_symbol().code() );
-      const auto new_tokens = static_cast<int64_t>( (continuous_rate * double(token_supply.amount) * double(usecs_since_last_fill)) / double(useconds_per_year) );
+      reward_rates_singleton rates_table( _self, _self.value );
+      const auto rates = rates_table.get_or_default();
 
-      const auto network_rewards          = network_rewards_rate * new_tokens;
-      const auto infrastructure_rewards   = infrastructure_rewards_rate * new_tokens;
+      // shares are rounded down, the last share of each group takes the remainder so that a group
+      // distributes exactly the amount it received
+      const int64_t network_rewards          = share_of( new_tokens, rates.network );
+      const int64_t infrastructure_rewards   = new_tokens - network_rewards;
 
-      const auto to_producers             = bp_rewards_rate * network_rewards;
+      const int64_t to_producers             = share_of( network_rewards, rates.producers );
+      const int64_t to_dapps                 = share_of( network_rewards, rates.dapps );
+      const int64_t to_witnesses             = share_of( network_rewards, rates.witnesses );
+      const int64_t to_voters                = network_rewards - to_producers - to_dapps - to_witnesses;
 
-      const auto to_dapps                 = dapps_rewards_rate * network_rewards;
-      const auto to_witnesses             = witnesses_rewards_rate * network_rewards;
-      const auto to_voters                = vote_rewards_rate * network_rewards;
-      
-      const auto to_community             = community_rewards_rate * infrastructure_rewards;
-      const auto to_marketing             = marketing_rewards_rate * infrastructure_rewards;
-      const auto to_founding              = founding_rewards_rate * infrastructure_rewards;
+      const int64_t to_community             = share_of( infrastructure_rewards, rates.community );
+      const int64_t to_marketing             = share_of( infrastructure_rewards, rates.marketing );
+      const int64_t to_founding              = infrastructure_rewards - to_community - to_marketing;
+
+      const int64_t to_oracle                = share_of( to_community, rates.oracle );
 
-      const auto to_oracle                = oracle_rewards_rate * to_community;
+      const int64_t to_dapps_per_transfer    = to_dapps / 2;
 
       INLINE_ACTION_SENDER(eosio::token, issue)(
          token_account, { {_self, active_permission} },
@@ -538,12 +527,60 @@ namespace eosiosystem {
          { network_account, vpay_account, asset(to_voters, core_symbol()), "For Voters fund" }
       );
 
-      _gstate.perblock_bucket                       += to_producers;
-      _gstate.dapps_per_transfer_rewards_bucket     += 0.5 * to_dapps;
-      _gstate.dapps_per_user_rewards_bucket         += 0.5 * to_dapps;
-      _gstate.perwitness_bucket                     += to_witnesses;
-      _gstate.pervote_bucket                        += to_voters;
-      _gstate.oracle_bucket                         += to_oracle;
-      _gstate.last_pervote_bucket_fill               = ct;
+      _gcounters->perblock_bucket                       += to_producers;
+      _gcounters->dapps_per_transfer_rewards_bucket     += to_dapps_per_transfer;
+      _gcounters->dapps_per_user_rewards_bucket         += to_dapps - to_dapps_per_transfer;
+      _gcounters->perwitness_bucket                     += to_witnesses;
+      distribute_voter_rewards( to_voters, period );
+      _gcounters->oracle_bucket                         += to_oracle;
+   }
+
+   /**
+    *  Streams amount into the voter reward index over period, together with rewards released while
+    *  nobody voted. If the stream of an earlier settlement is still running, amount is added to it
+    *  and released by its end. Voting right before a settlement therefore earns only for the time
+    *  the vote power is kept afterwards.
+    */
+   void system_contract::distribute_voter_rewards( int64_t amount, microseconds period ) {
+      const auto ct = current_time_point();
+      voter_reward_singleton reward_table( _self, _self.value );
+      auto rewards = reward_table.get_or_default();
+      rewards.advance( ct );
+      rewards.streaming    += amount + rewards.undistributed;
+      rewards.undistributed = 0;
+      // an early settlement joins the stream that is still running, it does not delay its end
+      if( rewards.stream_end <= ct ) {
+         rewards.stream_end = ct + period;
+      }
+      reward_table.set( rewards, _self );
+   }
+
+   void system_contract::setrwdrates( const reward_rates& rates ) {
+      require_auth( get_self() );
+      check( uint32_t(rates.network) + rates.infrastructure == rate_basis_points,
+             "network and infrastructure rates must add up to 100%" );
+      check( uint32_t(rates.producers) + rates.dapps + rates.witnesses + rates.voters == rate_basis_points,
+             "producers, dapps, witnesses and voters rates must add up to 100%" );
+      check( uint32_t(rates.community) + rates.marketing + rates.founding == rate_basis_points,
+             "community, marketing and founding rates must add up to 100%" );
+      check( rates.oracle <= rate_basis_points, "oracle rate cannot exceed 100%" );
+
+      reward_rates_singleton rates_table( get_self(), get_self().value );
+      rates_table.set( rates, get_self() );
+   }
+
+   void system_contract::settleinfl() {
+      require_auth( get_self() );
+      share_inflation( true );
+   }
+
+   void system_contract::setinflprd( uint32_t period_in_hours )
+   {
+      require_auth( get_self() );
+
+      inflation_state_singleton inflation_table( _self, _self.value );
+      auto inflation = inflation_table.get_or_default();
+      inflation.settlement_period = eosio::hours( period_in_hours );
+      inflation_table.set( inflation, _self );
    }
 } //namespace eosiosystem
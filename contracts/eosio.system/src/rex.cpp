@@ -658,8 +658,10 @@ namespace eosiosystem {
     * @brief Performs maintenance operations on expired NET and CPU loans and sellrex oders
     *
     * @param max - maximum number of each of the three categories to be processed
+    *
+    * @return number of loans processed and sellrex orders filled
     */
-   void system_contract::runrex( uint16_t max )
+   uint16_t system_contract::runrex( uint16_t max )
    {
       check( rex_system_initialized(), "rex system not initialized yet" );
 
@@ -703,6 +705,8 @@ namespace eosiosystem {
          });
       }
 
+      uint16_t processed = 0;
+
       /// process cpu loans
       {
          rex_cpu_loan_table cpu_loans( _self, _self.value );
@@ -710,6 +714,7 @@ namespace eosiosystem {
          for ( uint16_t i = 0; i < max; ++i ) {
             auto itr = cpu_idx.begin();
             if ( itr == cpu_idx.end() || itr->expiration > current_time_point() ) break;
+            ++processed;
 
             auto result = process_expired_loan( cpu_idx, itr );
             if ( result.second != 0 )
@@ -727,6 +732,7 @@ namespace eosiosystem {
          for ( uint16_t i = 0; i < max; ++i ) {
             auto itr = net_idx.begin();
             if ( itr == net_idx.end() || itr->expiration > current_time_point() ) break;
+            ++processed;
 
             auto result = process_expired_loan( net_idx, itr );
             if ( result.second != 0 )
@@ -749,6 +755,7 @@ namespace eosiosystem {
             if ( bitr != _rexbalance.end() ) { // should always be true
                auto result = fill_rex_order( bitr, oitr->rex_requested );
                if ( result.success ) {
+                  ++processed; // an order that cannot be filled yet is not counted
                   const name order_owner = oitr->owner;
                   idx.modify( oitr, same_payer, [&]( auto& order ) {
                      order.proceeds.amount     = result.proceeds.amount;
@@ -764,6 +771,7 @@ namespace eosiosystem {
          }
       }
 
+      return processed;
    }
 
    template <typename T>
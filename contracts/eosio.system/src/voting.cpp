@@ -11,6 +11,7 @@
 #include <eosio.token/eosio.token.hpp>
 
 #include <algorithm>
+#include <iterator>
 #include <cmath>
 
 namespace eosiosystem {
@@ -19,6 +20,8 @@ namespace eosiosystem {
    using eosio::singleton;
    using eosio::transaction;
 
+   static constexpr uint32_t max_vote_batch_size = 100;
+
    /**
     *  This method will create a producer_config and producer_info object for 'producer'
     *
@@ -35,6 +38,8 @@ namespace eosiosystem {
       check(producer_name -> staked > 1000000000, "You have 100'000 EOS tokens to become a Block Producer");
       auto prod = _producers.find( producer.value );
       const auto ct = current_time_point();
+      // reactivating a producer may bring it back into the witness set
+      const auto witnesses_before = get_current_witnesses();
 
       if ( prod != _producers.end() ) {
          _producers.modify( prod, producer, [&]( producer_info& info ){
@@ -46,11 +51,12 @@ namespace eosiosystem {
                info.last_claim_time = ct;
          });
 
-         auto prod2 = _producers2.find( producer.value );
-         if ( prod2 == _producers2.end() ) {
-            _producers2.emplace( producer, [&]( producer_info2& info ){
-               info.owner                     = producer;
-               info.last_votepay_share_update = ct;
+         auto prod_pay = find_producer_pay( producer );
+         if ( prod_pay == _producerpay.end() ) {
+            _producerpay.emplace( producer, [&]( producer_pay_info& info ){
+               info.owner                        = producer;
+               info.last_votepay_share_update    = ct;
+               info.last_witnesspay_share_update = ct;
             });
             update_total_votepay_share( ct, 0.0, prod->total_votes );
             // When introducing the producer2 table row for the first time, the producer's votes must also be accounted for in the global total_producer_votepay_share at the same time.
@@ -65,39 +71,45 @@ namespace eosiosystem {
             info.location        = location;
             info.last_claim_time = ct;
          });
-         _producers2.emplace( producer, [&]( producer_info2& info ){
-            info.owner                     = producer;
-            info.last_votepay_share_update = ct;
-         });
-         _producers3.emplace( producer, [&]( producer_info3& info ){
-            info.owner                     = producer;
+         _producerpay.emplace( producer, [&]( producer_pay_info& info ){
+            info.owner                        = producer;
+            info.last_votepay_share_update    = ct;
             info.last_witnesspay_share_update = ct;
          });
       }
+      update_witnesses( witnesses_before, ct );
    }
 
    void system_contract::unregprod( const name producer ) {
       require_auth( producer );
 
+      const auto witnesses_before = get_current_witnesses();
       const auto& prod = _producers.get( producer.value, "producer not found" );
       _producers.modify( prod, same_payer, [&]( producer_info& info ){
          info.deactivate();
       });
+      update_witnesses( witnesses_before, current_time_point() );
    }
 
    void system_contract::update_elected_producers( block_timestamp block_time ) {
-      _gstate.last_producer_schedule_update = block_time;
+      _gcounters->last_producer_schedule_update = block_time;
 
       auto idx = _producers.get_index<"prototalvote"_n>();
 
       std::vector< std::pair<eosio::producer_key,uint16_t> > top_producers;
       top_producers.reserve(21);
 
+      std::vector<name> top_producer_names;
+      top_producer_names.reserve(21);
+
       for ( auto it = idx.cbegin(); it != idx.cend() && top_producers.size() < 21 && 0 < it->total_votes && it->active(); ++it ) {
          top_producers.emplace_back( std::pair<eosio::producer_key,uint16_t>({{it->owner, it->producer_key}, it->location}) );
+         top_producer_names.push_back( it->owner );
       }
 
-      if ( top_producers.size() < _gstate.last_producer_schedule_size ) {
+      refresh_oracle_roster( top_producer_names );
+
+      if ( top_producers.size() < _gstate->last_producer_schedule_size ) {
          return;
       }
 
@@ -112,8 +124,23 @@ namespace eosiosystem {
 
       auto packed_schedule = pack(producers);
 
+      // skip the proposal if the sorted owner and key pairs did not change since the last accepted one,
+      // the counters are in globalcounts that a schedule update writes anyway
+      producer_schedule_singleton schedule_table( _self, _self.value );
+      auto schedule_state = schedule_table.get_or_default();
+      capi_checksum256 schedule_hash;
+      sha256( packed_schedule.data(), packed_schedule.size(), &schedule_hash );
+      if( std::equal( std::begin(schedule_hash.hash), std::end(schedule_hash.hash), std::begin(schedule_state.last_proposed_hash.hash) ) ) {
+         _gcounters->skipped_schedules++;
+         return;
+      }
+
+      // a schedule that is not accepted, e.g. while an earlier proposal is not pending yet, is proposed again next time
       if( set_proposed_producers( packed_schedule.data(),  packed_schedule.size() ) >= 0 ) {
-         _gstate.last_producer_schedule_size = static_cast<decltype(_gstate.last_producer_schedule_size)>( top_producers.size() );
+         _gstate->last_producer_schedule_size = static_cast<decltype(_gstate->last_producer_schedule_size)>( top_producers.size() );
+         _gcounters->proposed_schedules++;
+         schedule_state.last_proposed_hash = schedule_hash;
+         schedule_table.set( schedule_state, _self );
       }
    }
 
@@ -125,37 +152,79 @@ namespace eosiosystem {
 
    double system_contract::update_total_votepay_share( time_point ct, double additional_shares_delta, double shares_rate_delta ){
       double delta_total_votepay_share = 0.0;
-      if( ct > _gstate3.last_vpay_state_update ) {
-         delta_total_votepay_share = _gstate3.total_vpay_share_change_rate
-                                       * double( (ct - _gstate3.last_vpay_state_update).count() / 1E6 );
+      if( ct > _gstate3->last_vpay_state_update ) {
+         delta_total_votepay_share = _gstate3->total_vpay_share_change_rate
+                                       * double( (ct - _gstate3->last_vpay_state_update).count() / 1E6 );
       }
 
       delta_total_votepay_share += additional_shares_delta;
-      if( delta_total_votepay_share < 0 && _gstate2.total_producer_votepay_share < -delta_total_votepay_share ) {
-         _gstate2.total_producer_votepay_share = 0.0;
+      if( delta_total_votepay_share < 0 && _gstate2->total_producer_votepay_share < -delta_total_votepay_share ) {
+         _gstate2->total_producer_votepay_share = 0.0;
       } else {
-         _gstate2.total_producer_votepay_share += delta_total_votepay_share;
+         _gstate2->total_producer_votepay_share += delta_total_votepay_share;
       }
 
-      if( shares_rate_delta < 0 && _gstate3.total_vpay_share_change_rate < -shares_rate_delta ) {
-         _gstate3.total_vpay_share_change_rate = 0.0;
+      if( shares_rate_delta < 0 && _gstate3->total_vpay_share_change_rate < -shares_rate_delta ) {
+         _gstate3->total_vpay_share_change_rate = 0.0;
       } else {
-         _gstate3.total_vpay_share_change_rate += shares_rate_delta;
+         _gstate3->total_vpay_share_change_rate += shares_rate_delta;
       }
 
-      _gstate3.last_vpay_state_update = ct;
+      _gstate3->last_vpay_state_update = ct;
+
+      return _gstate2->total_producer_votepay_share;
+   }
 
-      return _gstate2.total_producer_votepay_share;
+   /**
+    *  Returns the producerpay row of owner. On first access the producer's producers2 and producers3
+    *  rows are moved into a new producerpay row, either of them may be missing. end() is returned if
+    *  the producer has no vote pay state.
+    */
+   producers_pay_table::const_iterator system_contract::find_producer_pay( const name& owner ) {
+      auto itr = _producerpay.find( owner.value );
+      if ( itr != _producerpay.end() ) {
+         return itr;
+      }
+
+      auto prod2 = _producers2.find( owner.value );
+      auto prod3 = _producers3.find( owner.value );
+      if ( prod2 == _producers2.end() && prod3 == _producers3.end() ) {
+         return itr;
+      }
+      const auto ct = current_time_point();
+      itr = _producerpay.emplace( _self, [&]( producer_pay_info& info ){
+         info.owner = owner;
+         if ( prod2 != _producers2.end() ) {
+            info.votepay_share             = prod2->votepay_share;
+            info.last_votepay_share_update = prod2->last_votepay_share_update;
+         } else {
+            info.last_votepay_share_update = ct;
+         }
+         if ( prod3 != _producers3.end() ) {
+            info.witnesspay_share             = prod3->witnesspay_share;
+            info.last_witnesspay_share_update = prod3->last_witnesspay_share_update;
+         } else {
+            info.last_witnesspay_share_update = ct;
+         }
+      });
+
+      if ( prod2 != _producers2.end() ) {
+         _producers2.erase( prod2 );
+      }
+      if ( prod3 != _producers3.end() ) {
+         _producers3.erase( prod3 );
+      }
+      return itr;
    }
 
-   double system_contract::update_producer_votepay_share( const producers_table2::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero ){
+   double system_contract::update_producer_votepay_share( const producers_pay_table::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero ){
       double delta_votepay_share = 0.0;
       if( shares_rate > 0.0 && ct > prod_itr->last_votepay_share_update ) {
          delta_votepay_share = shares_rate * double( (ct - prod_itr->last_votepay_share_update).count() / 1E6 ); // cannot be negative
       }
 
       double new_votepay_share = prod_itr->votepay_share + delta_votepay_share;
-      _producers2.modify( prod_itr, same_payer, [&](auto& p) {
+      _producerpay.modify( prod_itr, same_payer, [&](auto& p) {
          if( reset_to_zero )
             p.votepay_share = 0.0;
          else
@@ -170,37 +239,37 @@ namespace eosiosystem {
    double system_contract::update_total_witnesspay_share( time_point ct, double additional_shares_delta, double shares_rate_delta ){
       double delta_total_witnesspay_share = 0.0;
       eosio::print("=== shares_rate_delta ===",shares_rate_delta);
-      if( ct > _gstate4.last_wpay_state_update ) {
-         delta_total_witnesspay_share = _gstate4.total_wpay_share_change_rate * double( (ct - _gstate4.last_wpay_state_update).count() / 1E6 );
+      if( ct > _gstate4->last_wpay_state_update ) {
+         delta_total_witnesspay_share = _gstate4->total_wpay_share_change_rate * double( (ct - _gstate4->last_wpay_state_update).count() / 1E6 );
       }
 
       delta_total_witnesspay_share += additional_shares_delta;
-      if( delta_total_witnesspay_share < 0 && _gstate4.total_producer_witnesspay_share < -delta_total_witnesspay_share ) {
-         _gstate4.total_producer_witnesspay_share = 0.0;
+      if( delta_total_witnesspay_share < 0 && _gstate4->total_producer_witnesspay_share < -delta_total_witnesspay_share ) {
+         _gstate4->total_producer_witnesspay_share = 0.0;
       } else {
-         _gstate4.total_producer_witnesspay_share += delta_total_witnesspay_share;
+         _gstate4->total_producer_witnesspay_share += delta_total_witnesspay_share;
       }
 
-      if( shares_rate_delta < 0 && _gstate4.total_wpay_share_change_rate < -shares_rate_delta ) {
-         _gstate4.total_wpay_share_change_rate = 0.0;
+      if( shares_rate_delta < 0 && _gstate4->total_wpay_share_change_rate < -shares_rate_delta ) {
+         _gstate4->total_wpay_share_change_rate = 0.0;
       } else {
          eosio::print("=== shares_rate_delta ===",shares_rate_delta);
-         _gstate4.total_wpay_share_change_rate += shares_rate_delta;
+         _gstate4->total_wpay_share_change_rate += shares_rate_delta;
       }
 
-      _gstate4.last_wpay_state_update = ct;
+      _gstate4->last_wpay_state_update = ct;
 
-      return _gstate4.total_producer_witnesspay_share;
+      return _gstate4->total_producer_witnesspay_share;
    }
 
-   double system_contract::update_producer_witnesspay_share( const producers_table3::const_iterator& prod3_itr, time_point ct, double shares_rate, bool reset_to_zero ){
+   double system_contract::update_producer_witnesspay_share( const producers_pay_table::const_iterator& prod_itr, time_point ct, double shares_rate, bool reset_to_zero ){
       double delta_witnesspay_share = 0.0;
-      if( shares_rate > 0.0 && ct > prod3_itr->last_witnesspay_share_update ) {
-         delta_witnesspay_share = shares_rate * double( (ct - prod3_itr->last_witnesspay_share_update).count() / 1E6 ); // cannot be negative
+      if( shares_rate > 0.0 && ct > prod_itr->last_witnesspay_share_update ) {
+         delta_witnesspay_share = shares_rate * double( (ct - prod_itr->last_witnesspay_share_update).count() / 1E6 ); // cannot be negative
       }
 
-      double new_votepay_share = prod3_itr->witnesspay_share + delta_witnesspay_share;
-      _producers3.modify( prod3_itr, same_payer, [&](auto& p) {
+      double new_votepay_share = prod_itr->witnesspay_share + delta_witnesspay_share;
+      _producerpay.modify( prod_itr, same_payer, [&](auto& p) {
          if( reset_to_zero )
             p.witnesspay_share = 0.0;
          else
@@ -212,6 +281,74 @@ namespace eosiosystem {
       return new_votepay_share;
    }
 
+   /**
+    *  Builds the sorted witness set from the prototalvote index.
+    */
+   std::vector<name> system_contract::get_witnesses()const {
+      std::vector<name> witnesses;
+      witnesses.reserve( max_witness_count );
+      auto idx = _producers.get_index<"prototalvote"_n>();
+      for ( auto it = idx.cbegin(); it != idx.cend() && witnesses.size() < max_witness_count && (it->total_votes / _gcounters->total_producer_vote_weight) > min_witness_vote_share && it->active(); ++it ) {
+         witnesses.emplace_back( it->owner );
+      }
+      std::sort( witnesses.begin(), witnesses.end() );
+      return witnesses;
+   }
+
+   /**
+    *  Returns the persisted witness set. Until the "witnesses" singleton has been written
+    *  for the first time it is derived from the prototalvote index.
+    */
+   std::vector<name> system_contract::get_current_witnesses()const {
+      witness_state_singleton witnesses_table( _self, _self.value );
+      if ( witnesses_table.exists() ) {
+         return witnesses_table.get().witnesses;
+      }
+      return get_witnesses();
+   }
+
+   /**
+    *  Compares witnesses_before with the witness set after a vote change, settles witnesspay
+    *  share of producers that left or joined the set and persists the new set.
+    *
+    *  @pre witnesses_before must be sorted
+    */
+   void system_contract::update_witnesses( const std::vector<name>& witnesses_before, time_point ct ) {
+      const auto witnesses_after = get_witnesses();
+
+      std::vector<name> witnesses_out;
+      std::vector<name> witnesses_in;
+      std::set_difference( witnesses_before.begin(), witnesses_before.end(),
+                           witnesses_after.begin(), witnesses_after.end(),
+                           std::back_inserter(witnesses_out) );
+      std::set_difference( witnesses_after.begin(), witnesses_after.end(),
+                           witnesses_before.begin(), witnesses_before.end(),
+                           std::back_inserter(witnesses_in) );
+
+      double witness_delta_change_rate = 0.0;
+      for ( const auto& witness: witnesses_out ) {
+         auto pitr = find_producer_pay( witness );
+         check( pitr != _producerpay.end(), "producer not found" );
+         update_producer_witnesspay_share( pitr, ct, 1.0, false ); // 1.0 means that producer have had a share until this moment
+         witness_delta_change_rate -= 1.0;
+      }
+      for ( const auto& witness: witnesses_in ) {
+         auto pitr = find_producer_pay( witness );
+         check( pitr != _producerpay.end(), "producer not found" );
+         update_producer_witnesspay_share( pitr, ct, 0.0, false ); // 0.0 means that producer haven`t had a share until this moment
+         witness_delta_change_rate += 1.0;
+      }
+
+      update_total_witnesspay_share( ct, 0.0, witness_delta_change_rate );
+
+      witness_state_singleton witnesses_table( _self, _self.value );
+      if ( !witnesses_table.exists() || !witnesses_out.empty() || !witnesses_in.empty() ) {
+         witness_state ws;
+         ws.witnesses = witnesses_after;
+         witnesses_table.set( ws, _self );
+      }
+   }
+
    /**
     *  @pre producers must be sorted from lowest to highest and must be registered and active
     *  @pre if proxy is set then no producers can be voted for
@@ -231,26 +368,68 @@ namespace eosiosystem {
    void system_contract::voteproducer( const name voter_name, const name proxy, const std::vector<name>& producers ) {
       require_auth( voter_name );
 
+      const auto witnesses_before = get_current_witnesses();
+      producer_deltas_map producer_deltas;
+      voter_rewards_batch rewards;
+      cast_vote( voter_name, proxy, producers, producer_deltas, rewards );
+      apply_producer_deltas( producer_deltas, true );
+      apply_voter_rewards( rewards );
+      update_witnesses( witnesses_before, current_time_point() );
+   }
+
+   /**
+    *  Casts the same vote as voteproducer for every account in voters. Producer rows, the witness
+    *  set, the global votepay share and the voter reward index are updated once for the whole batch.
+    *
+    *  @pre voters must be sorted from lowest to highest and every voter must authorize this action
+    */
+   void system_contract::votebatch( const std::vector<name>& voters, const name proxy, const std::vector<name>& producers ) {
+      check( !voters.empty(), "no voters specified" );
+      check( voters.size() <= max_vote_batch_size, "attempt to vote for too many voters" );
+      for( size_t i = 1; i < voters.size(); ++i ) {
+         check( voters[i-1] < voters[i], "voters must be unique and sorted" );
+      }
+
+      const auto witnesses_before = get_current_witnesses();
+      producer_deltas_map producer_deltas;
+      voter_rewards_batch rewards;
+      for( const auto& voter_name : voters ) {
+         require_auth( voter_name );
+         cast_vote( voter_name, proxy, producers, producer_deltas, rewards );
+      }
+      apply_producer_deltas( producer_deltas, true, max_producer_deltas * voters.size() );
+      apply_voter_rewards( rewards );
+      update_witnesses( witnesses_before, current_time_point() );
+   }
+
+   void system_contract::cast_vote( const name voter_name, const name proxy, const std::vector<name>& producers, producer_deltas_map& producer_deltas, voter_rewards_batch& rewards ) {
       check( _producers.find( voter_name.value ) == _producers.end(), "Producers are not allowed to vote" );
 
       vote_stake_updater( voter_name );
-      update_votes( voter_name, proxy, producers, true );
+      accumulate_votes( voter_name, proxy, producers, true, producer_deltas, rewards );
       auto rex_itr = _rexbalance.find( voter_name.value );
       if( rex_itr != _rexbalance.end() && rex_itr->rex_balance.amount > 0 ) {
          check_voting_requirement( voter_name, "voter holding REX tokens must vote for at least 21 producers or for a proxy" );
       }
-
-      const auto& voter = _voters.get( voter_name.value, "user must stake before they can vote" );
-      _voters.modify( voter, same_payer, [&]( auto& av ) {
-         // av.unpaid_votes            += 1;
-         // _gstate.total_unpaid_votes += 1;
-         const auto vote_power = std::min( av.staked, _gstate.max_vote_power );
-         av.unpaid_votes            += vote_power;
-         _gstate.total_unpaid_votes += vote_power;
-      });
    }
 
    void system_contract::update_votes( const name voter_name, const name proxy, const std::vector<name>& producers, bool voting ) {
+      // Witnesses (top 50 producers with vote > 0.5%) before the update of total_votes
+      const auto witnesses_before = get_current_witnesses();
+      producer_deltas_map producer_deltas;
+      voter_rewards_batch rewards;
+      accumulate_votes( voter_name, proxy, producers, voting, producer_deltas, rewards );
+      apply_producer_deltas( producer_deltas, voting );
+      apply_voter_rewards( rewards );
+      update_witnesses( witnesses_before, current_time_point() );
+   }
+
+   /**
+    *  Updates voter and proxy rows for the new vote and adds the resulting vote weight changes
+    *  to producer_deltas. Producer rows are updated later by apply_producer_deltas, the voter reward
+    *  index by apply_voter_rewards.
+    */
+   void system_contract::accumulate_votes( const name voter_name, const name proxy, const std::vector<name>& producers, bool voting, producer_deltas_map& producer_deltas, voter_rewards_batch& rewards ) {
       //validate input
       if ( proxy ) {
          check( producers.size() == 0, "cannot vote for producers and proxy at same time" );
@@ -266,39 +445,25 @@ namespace eosiosystem {
       check( voter != _voters.end(), "user must stake before they can vote" ); /// staking creates voter object
       check( !proxy || !voter->is_proxy, "account registered as a proxy is not allowed to use a proxy" );
 
-      // We need to get top 50 producers with vote > 0.5% before and after update of total_votes
-      const uint32_t max_witness_count = 50;
-      std::vector<name> witnesses_before;
-      std::vector<name> witnesses_after;
-      witnesses_before.reserve(max_witness_count);
-      witnesses_after.reserve(max_witness_count);
-      auto idx = _producers.get_index<"prototalvote"_n>();
-      for ( auto it = idx.cbegin(); it != idx.cend() && witnesses_before.size() < max_witness_count && (it->total_votes / _gstate.total_producer_vote_weight) > 0.005 && it->active(); ++it ) {
-         witnesses_before.emplace_back( it->owner );
-         eosio::print("+++ witnesses_before: ",it->owner);
-      }
-      std::sort(std::begin(witnesses_before), std::end(witnesses_before));
-         
       /**
        * The first time someone votes we calculate and set last_vote_weight, since they cannot unstake until
        * after total_activated_stake hits threshold, we can use last_vote_weight to determine that this is
        * their first vote and should consider their stake activated.
        */
       if( voter->last_vote_weight <= 0.0 ) {
-         _gstate.total_activated_stake += voter->staked;
-         if( _gstate.total_activated_stake >= min_activated_stake && _gstate.thresh_activated_stake_time == time_point() ) {
-            _gstate.thresh_activated_stake_time = current_time_point();
+         _gcounters->total_activated_stake += voter->staked;
+         if( _gcounters->total_activated_stake >= min_activated_stake && _gstate->thresh_activated_stake_time == time_point() ) {
+            _gstate->thresh_activated_stake_time = current_time_point();
          }
       }
 
       // vote power has upper limit of _gstate.max_vote_power
       // auto new_vote_weight = stake2vote( std::max( voter->staked, _gstate.max_vote_power ) );
-      auto new_vote_weight = stake2vote( std::min( voter->staked, _gstate.max_vote_power ) );
+      auto new_vote_weight = stake2vote( std::min( voter->staked, _gstate->max_vote_power ) );
       if( voter->is_proxy ) {
          new_vote_weight += voter->proxied_vote_weight;
       }
 
-      boost::container::flat_map<name, pair<double, bool /*new*/> > producer_deltas;
       if ( voter->last_vote_weight > 0 ) {
          if( voter->proxy ) {
             auto old_proxy = _voters.find( voter->proxy.value );
@@ -306,12 +471,10 @@ namespace eosiosystem {
             _voters.modify( old_proxy, same_payer, [&]( auto& vp ) {
                   vp.proxied_vote_weight -= voter->last_vote_weight;
                });
-            propagate_weight_change( *old_proxy );
+            propagate_weight_change( *old_proxy, producer_deltas );
          } else {
             for( const auto& p : voter->producers ) {
-               auto& d = producer_deltas[p];
-               d.first -= voter->last_vote_weight;
-               d.second = false;
+               producer_deltas[p].first -= voter->last_vote_weight; // keeps the flag set by an earlier voter of a batch
             }
          }
       }
@@ -324,7 +487,7 @@ namespace eosiosystem {
             _voters.modify( new_proxy, same_payer, [&]( auto& vp ) {
                   vp.proxied_vote_weight += new_vote_weight;
                });
-            propagate_weight_change( *new_proxy );
+            propagate_weight_change( *new_proxy, producer_deltas );
          }
       } else {
          if( new_vote_weight >= 0 ) {
@@ -336,118 +499,97 @@ namespace eosiosystem {
          }
       }
 
-      const auto ct = current_time_point();
-      double delta_change_rate         = 0.0;
-      double total_inactive_vpay_share = 0.0;
-      for( const auto& pd : producer_deltas ) {
-         auto pitr = _producers.find( pd.first.value );
-         if( pitr != _producers.end() ) {
-            check( !voting || pitr->active() || !pd.second.second /* not from new set */, "producer is not currently registered" );
-            double init_total_votes = pitr->total_votes;
-            _producers.modify( pitr, same_payer, [&]( auto& p ) {
-               p.total_votes += pd.second.first;
-               if ( p.total_votes < 0 ) { // floating point arithmetics can give small negative numbers
-                  p.total_votes = 0;
-               }
-               _gstate.total_producer_vote_weight += pd.second.first;
-               //check( p.total_votes >= 0, "something bad happened" );
-            });
-            auto prod2 = _producers2.find( pd.first.value );
-            if( prod2 != _producers2.end() ) {
-               const auto last_claim_plus_3days = pitr->last_claim_time + microseconds(3 * useconds_per_day);
-               bool crossed_threshold       = (last_claim_plus_3days <= ct);
-               bool updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-               // Note: updated_after_threshold implies cross_threshold
+      _voters.modify( voter, same_payer, [&]( auto& av ) {
+         av.last_vote_weight = new_vote_weight;
+         av.producers = producers;
+         av.proxy     = proxy;
+      });
+      update_voter_pay( *voter, rewards );
+   }
 
-               double new_votepay_share = update_producer_votepay_share( prod2,
-                                             ct,
-                                             updated_after_threshold ? 0.0 : init_total_votes,
-                                             crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
-                                          );
+   /**
+    *  Accrues rewards of voter at the vote power it held so far and continues at its current power.
+    *  Nothing is written while the power stays the same, so casting the same vote again is free.
+    */
+   void system_contract::update_voter_pay( const voter_info& voter, voter_rewards_batch& rewards ) {
+      const int64_t vote_power = voter_pay_power( voter );
+      auto pay = _voterpay.find( voter.owner.value );
+      const int64_t old_power = pay != _voterpay.end() ? pay->vote_power : 0;
+      if( vote_power == old_power ) {
+         return;
+      }
 
-               if( !crossed_threshold ) {
-                  delta_change_rate += pd.second.first;
-               } else if( !updated_after_threshold ) {
-                  total_inactive_vpay_share += new_votepay_share;
-                  delta_change_rate -= init_total_votes;
-               }
-            }
-         } else {
-            check( !pd.second.second /* not from new set */, "producer is not registered" ); //data corruption
-         }
+      if( !rewards ) {
+         voter_reward_singleton reward_table( _self, _self.value );
+         rewards = reward_table.get_or_default();
+         rewards->advance( current_time_point() );
       }
+      set_voter_pay( pay, voter.owner, vote_power, *rewards, voter.owner );
+   }
 
-      for ( auto it = idx.cbegin(); it != idx.cend() && witnesses_after.size() < max_witness_count && (it->total_votes / _gstate.total_producer_vote_weight) > 0.005 && it->active(); ++it ) {
-         witnesses_after.emplace_back( it->owner );
-         eosio::print("=== witnesses_after",it->owner);
+   /**
+    *  Writes the voter reward index once for all vote power changes of the action.
+    */
+   void system_contract::apply_voter_rewards( const voter_rewards_batch& rewards ) {
+      if( rewards ) {
+         voter_reward_singleton reward_table( _self, _self.value );
+         reward_table.set( *rewards, _self );
       }
-      std::sort(std::begin(witnesses_after), std::end(witnesses_after));
+   }
 
-      // After getting witnesses before and after update of total_votes 
-      // we get producers that fell out of witness list and producers that got in witness list
-      std::vector<name> witnesses_out;
-      std::vector<name> witnesses_in;
-      // eosio::print("ppppppppppppppppppppp",witnesses_before);
-      
-      // for(auto& prod: witnesses_after){
-      //    eosio::print("aaaaaaaaaaaaaaaaaaaaa",prod);
-      // }
-      // for(auto& prod2: witnesses_before){
-      //    eosio::print("bbbbbbbbbbbbbbbbbbbbbb",prod2);
-      // }
-      // std::set_difference(std::begin(witnesses_before), std::end(witnesses_before),
-      //                      std::begin(witnesses_after), std::end(witnesses_after),
-      //                      std::back_inserter(witnesses_out));
-
-      // std::set_difference(std::begin(witnesses_after), std::end(witnesses_after),
-      //                      std::begin(witnesses_before), std::end(witnesses_before),
-      //                      std::back_inserter(witnesses_in));
-      double witness_delta_change_rate = 0.0;
-      for (const auto& wb: witnesses_before) {
-         if (std::find(std::begin(witnesses_after), std::end(witnesses_after), wb) == std::end(witnesses_after)) {
-            witnesses_out.push_back(wb);
-            print("===== witness before ===",wb);
-            auto pitr = _producers3.find( wb.value );
-            check( pitr != _producers3.end(), "producer not found" );
-            update_producer_witnesspay_share( pitr, ct, 1.0, false);
-            witness_delta_change_rate -= 1.0;
-         }
+   int64_t system_contract::voter_pay_power( const voter_info& voter )const {
+      const bool is_voting = voter.proxy || !voter.producers.empty();
+      return is_voting ? std::min( voter.staked, _gstate->max_vote_power ) : 0;
+   }
+
+   /**
+    *  Sets vote power of owner in its voterpay row, pay, after accruing rewards at the old power.
+    *  rewards must be advanced to the current time.
+    */
+   void system_contract::set_voter_pay( voters_pay_table::const_iterator pay, const name owner, int64_t vote_power,
+                                        voter_reward_state& rewards, const name payer ) {
+      const int64_t old_power = pay != _voterpay.end() ? pay->vote_power : 0;
+      if( pay == _voterpay.end() ) {
+         _voterpay.emplace( payer, [&]( auto& vp ) {
+            vp.owner            = owner;
+            vp.vote_power       = vote_power;
+            vp.reward_per_power = rewards.reward_per_power;
+         });
+      } else {
+         _voterpay.modify( pay, same_payer, [&]( auto& vp ) {
+            vp.unpaid_rewards  += vp.accrued( rewards.reward_per_power );
+            vp.reward_per_power = rewards.reward_per_power;
+            vp.vote_power       = vote_power;
+         });
       }
-      for (const auto& wa: witnesses_after) {
-         if (std::find(std::begin(witnesses_before), std::end(witnesses_before), wa) == std::end(witnesses_before)) {
-            witnesses_in.push_back(wa);
-            print("===== witness after ===",wa);
-            auto pitr = _producers3.find( wa.value );
-            check( pitr != _producers3.end(), "producer not found" );
-            update_producer_witnesspay_share( pitr, ct, 0.0, false);
-            witness_delta_change_rate += 1.0;
+      rewards.total_vote_power += vote_power - old_power;
+   }
+
+   void system_contract::backfillvpay( uint16_t max_rows ) {
+      require_auth( _self );
+      check( max_rows > 0, "max_rows must be positive" );
+
+      voter_reward_singleton reward_table( _self, _self.value );
+      auto rewards = reward_table.get_or_default();
+      check( !rewards.backfill_done, "voter pay rows are already backfilled" );
+      rewards.advance( current_time_point() );
+
+      auto it = _voters.lower_bound( rewards.backfill_cursor.value );
+      for( uint16_t i = 0; i < max_rows && it != _voters.end(); ++i, ++it ) {
+         const int64_t vote_power = voter_pay_power( *it );
+         auto pay = _voterpay.find( it->owner.value );
+         // voters that voted since the index exists are registered already
+         if( pay == _voterpay.end() && vote_power > 0 ) {
+            set_voter_pay( pay, it->owner, vote_power, rewards, _self );
          }
       }
 
-      // After that we need to update share calculation mechanism
-    //   for (const auto& witness: witnesses_out) {
-    //      eosio::print("###############################################", witness,"\n");
-    //      auto pitr = _producers3.find( witness.value );
-    //      check( pitr != _producers3.end(), "producer not found" );
-    //      update_producer_witnesspay_share( pitr, ct, 1.0, false); // 1.0 means that producer have had a share until this moment
-    //      witness_delta_change_rate += 1.0;
-    //   }
-    //   for (const auto& witness: witnesses_in) {
-    //      eosio::print("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@", witness,"\n");
-    //      auto pitr = _producers3.find( witness.value );
-    //      check( pitr != _producers3.end(), "producer not found" );
-    //      update_producer_witnesspay_share( pitr, ct, 0.0, false); // 0.0 means that producer haven`t had a share until this moment
-    //      witness_delta_change_rate -= 1.0;
-    //   }
-      update_total_witnesspay_share( ct, 0.0, witness_delta_change_rate );
-
-      update_total_votepay_share( ct, -total_inactive_vpay_share, delta_change_rate );
-
-      _voters.modify( voter, same_payer, [&]( auto& av ) {
-         av.last_vote_weight = new_vote_weight;
-         av.producers = producers;
-         av.proxy     = proxy;
-      });
+      if( it == _voters.end() ) {
+         rewards.backfill_done = true;
+      } else {
+         rewards.backfill_cursor = it->owner;
+      }
+      reward_table.set( rewards, _self );
    }
 
    /**
@@ -469,71 +611,13 @@ namespace eosiosystem {
          _voters.modify( pitr, same_payer, [&]( auto& p ) {
                p.is_proxy = isproxy;
             });
-         const auto ct = current_time_point();
-         const uint32_t max_witness_count = 50;
-         std::vector<name> witnesses_before;
-         std::vector<name> witnesses_after;
-         witnesses_before.reserve(max_witness_count);
-         witnesses_after.reserve(max_witness_count);
-         auto idx = _producers.get_index<"prototalvote"_n>();
-         for ( auto it = idx.cbegin(); it != idx.cend() && witnesses_before.size() < max_witness_count && (it->total_votes / _gstate.total_producer_vote_weight) > 0.005 && it->active(); ++it ) {
-            witnesses_before.emplace_back( it->owner );
-         }
-         std::sort(std::begin(witnesses_before), std::end(witnesses_before));
-
-         propagate_weight_change( *pitr );
-
-         for ( auto it = idx.cbegin(); it != idx.cend() && witnesses_after.size() < max_witness_count && (it->total_votes / _gstate.total_producer_vote_weight) > 0.005 && it->active(); ++it ) {
-            witnesses_after.emplace_back( it->owner );
-         }
-         std::sort(std::begin(witnesses_after), std::end(witnesses_after));
-
-         // std::vector<name> witnesses_out;
-         // std::vector<name> witnesses_in;
-         // std::set_difference(std::begin(witnesses_before), std::end(witnesses_before),
-         //                     std::begin(witnesses_after), std::end(witnesses_after),
-         //                     std::back_inserter(witnesses_out));
-         // std::set_difference(std::begin(witnesses_after), std::end(witnesses_after),
-         //                     std::begin(witnesses_before), std::end(witnesses_before),
-         //                     std::back_inserter(witnesses_in));
-
-         double witness_delta_change_rate = 0.0;
-         for (const auto& wb: witnesses_before) {
-            if (std::find(std::begin(witnesses_after), std::end(witnesses_after), wb) == std::end(witnesses_after)) {
-               // witnesses_out.push_back(wb);
-               print("===== witness before ===",wb);
-               auto pitr = _producers3.find( wb.value );
-               check( pitr != _producers3.end(), "producer not found" );
-               update_producer_witnesspay_share( pitr, ct, 1.0, false);
-               witness_delta_change_rate -= 1.0;
-            }
-         }
-         for (const auto& wa: witnesses_after) {
-            if (std::find(std::begin(witnesses_before), std::end(witnesses_before), wa) == std::end(witnesses_before)) {
-               // witnesses_in.push_back(wa);
-               print("===== witness after ===",wa);
-               auto pitr = _producers3.find( wa.value );
-               check( pitr != _producers3.end(), "producer not found" );
-               update_producer_witnesspay_share( pitr, ct, 0.0, false);
-               witness_delta_change_rate += 1.0;
-            }
-         }
+         const auto witnesses_before = get_current_witnesses();
 
-        //  for (const auto& witness: witnesses_out) {
-        //     auto pitr = _producers3.find( witness.value );
-        //     check( pitr != _producers3.end(), "producer not found" );
-        //     update_producer_witnesspay_share( pitr, ct, 1.0, false);
-        //     witness_delta_change_rate += 1.0;
-        //  }
-        //  for (const auto& witness: witnesses_in) {
-        //     auto pitr = _producers3.find( witness.value );
-        //     check( pitr != _producers3.end(), "producer not found" );
-        //     update_producer_witnesspay_share( pitr, ct, 0.0, false);
-        //     witness_delta_change_rate -= 1.0;
-        //  }
-
-         update_total_witnesspay_share( ct, 0.0, witness_delta_change_rate );
+         producer_deltas_map producer_deltas;
+         propagate_weight_change( *pitr, producer_deltas );
+         apply_producer_deltas( producer_deltas, false );
 
+         update_witnesses( witnesses_before, current_time_point() );
       } else {
          _voters.emplace( proxy, [&]( auto& p ) {
                p.owner  = proxy;
@@ -542,12 +626,18 @@ namespace eosiosystem {
       }
    }
 
-   void system_contract::propagate_weight_change( const voter_info& voter ) {
+   /**
+    *  Accumulates the change of voter's vote weight into producer_deltas, following the proxy
+    *  chain up to max_proxy_depth. Producer rows are not touched here, the caller applies all
+    *  accumulated deltas once with apply_producer_deltas.
+    */
+   void system_contract::propagate_weight_change( const voter_info& voter, producer_deltas_map& producer_deltas, uint32_t depth ) {
       check( !voter.proxy || !voter.is_proxy, "account registered as a proxy is not allowed to use a proxy" );
-      
+      check( depth < max_proxy_depth, "proxy chain is too deep" );
+
       // vote power has upper limit of _gstate.max_vote_power
       // auto new_weight = stake2vote( std::max( voter.staked, _gstate.max_vote_power ) );
-      auto new_weight = stake2vote( std::min( voter.staked, _gstate.max_vote_power ) );
+      auto new_weight = stake2vote( std::min( voter.staked, _gstate->max_vote_power ) );
       if ( voter.is_proxy ) {
          new_weight += voter.proxied_vote_weight;
       }
@@ -560,42 +650,12 @@ namespace eosiosystem {
                   p.proxied_vote_weight += new_weight - voter.last_vote_weight;
                }
             );
-            propagate_weight_change( proxy );
+            propagate_weight_change( proxy, producer_deltas, depth + 1 );
          } else {
-            auto delta = new_weight - voter.last_vote_weight;
-            const auto ct = current_time_point();
-            double delta_change_rate         = 0;
-            double total_inactive_vpay_share = 0;
+            const auto delta = new_weight - voter.last_vote_weight;
             for ( auto acnt : voter.producers ) {
-               auto& prod = _producers.get( acnt.value, "producer not found" ); //data corruption
-               const double init_total_votes = prod.total_votes;
-               _producers.modify( prod, same_payer, [&]( auto& p ) {
-                  p.total_votes += delta;
-                  _gstate.total_producer_vote_weight += delta;
-               });
-               auto prod2 = _producers2.find( acnt.value );
-               if ( prod2 != _producers2.end() ) {
-                  const auto last_claim_plus_3days = prod.last_claim_time + microseconds(3 * useconds_per_day);
-                  bool crossed_threshold       = (last_claim_plus_3days <= ct);
-                  bool updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-                  // Note: updated_after_threshold implies cross_threshold
-
-                  double new_votepay_share = update_producer_votepay_share( prod2,
-                                                ct,
-                                                updated_after_threshold ? 0.0 : init_total_votes,
-                                                crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
-                                             );
-
-                  if( !crossed_threshold ) {
-                     delta_change_rate += delta;
-                  } else if( !updated_after_threshold ) {
-                     total_inactive_vpay_share += new_votepay_share;
-                     delta_change_rate -= init_total_votes;
-                  }
-               }
+               producer_deltas[acnt].first += delta;
             }
-
-            update_total_votepay_share( ct, -total_inactive_vpay_share, delta_change_rate );
          }
       }
       _voters.modify( voter, same_payer, [&]( auto& v ) {
@@ -604,4 +664,58 @@ namespace eosiosystem {
       );
    }
 
+   /**
+    *  Applies accumulated vote weight changes, every producer and producerpay row is modified
+    *  at most once and the global votepay share is updated once.
+    *
+    *  @param voting - true if deltas come from voteproducer, then producers of the new vote must be active
+    *  @param max_deltas - upper bound on the number of producers touched
+    */
+   void system_contract::apply_producer_deltas( const producer_deltas_map& producer_deltas, bool voting, uint32_t max_deltas ) {
+      check( producer_deltas.size() <= max_deltas, "vote change touches too many producers" );
+
+      const auto ct = current_time_point();
+      double delta_change_rate         = 0.0;
+      double total_inactive_vpay_share = 0.0;
+      for( const auto& pd : producer_deltas ) {
+         auto pitr = _producers.find( pd.first.value );
+         if( pitr != _producers.end() ) {
+            check( !voting || pitr->active() || !pd.second.second /* not from new set */, "producer is not currently registered" );
+            double init_total_votes = pitr->total_votes;
+            _producers.modify( pitr, same_payer, [&]( auto& p ) {
+               p.total_votes += pd.second.first;
+               if ( p.total_votes < 0 ) { // floating point arithmetics can give small negative numbers
+                  p.total_votes = 0;
+               }
+               _gcounters->total_producer_vote_weight += pd.second.first;
+               //check( p.total_votes >= 0, "something bad happened" );
+            });
+            auto prod_pay = find_producer_pay( pd.first );
+            if( prod_pay != _producerpay.end() ) {
+               const auto last_claim_plus_3days = pitr->last_claim_time + microseconds(3 * useconds_per_day);
+               bool crossed_threshold       = (last_claim_plus_3days <= ct);
+               bool updated_after_threshold = (last_claim_plus_3days <= prod_pay->last_votepay_share_update);
+               // Note: updated_after_threshold implies cross_threshold
+
+               double new_votepay_share = update_producer_votepay_share( prod_pay,
+                                             ct,
+                                             updated_after_threshold ? 0.0 : init_total_votes,
+                                             crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
+                                          );
+
+               if( !crossed_threshold ) {
+                  delta_change_rate += pd.second.first;
+               } else if( !updated_after_threshold ) {
+                  total_inactive_vpay_share += new_votepay_share;
+                  delta_change_rate -= init_total_votes;
+               }
+            }
+         } else {
+            check( !pd.second.second /* not from new set */, "producer is not registered" ); //data corruption
+         }
+      }
+
+      update_total_votepay_share( ct, -total_inactive_vpay_share, delta_change_rate );
+   }
+
 } /// namespace eosiosystem
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <eosiolib/asset.hpp>
 #include <eosiolib/eosio.hpp>
 
+#include <eosio.system/contract_stats.hpp>
+
 #include <string>
 
 namespace eosiosystem {
@@ -78,8 +80,8 @@ namespace eosio {
             uint64_t primary_key()const { return supply.symbol.code().raw(); }
          };
 
-         typedef eosio::multi_index< "accounts"_n, account > accounts;
-         typedef eosio::multi_index< "stat"_n, currency_stats > stats;
+         typedef eosio::counted_multi_index< "accounts"_n, account > accounts;
+         typedef eosio::counted_multi_index< "stat"_n, currency_stats > stats;
 
          void sub_balance( name owner, asset value );
          void add_balance( name owner, asset value, name ram_payer );
@@ -189,4 +189,4 @@ void token::close( name owner, const symbol& symbol )
 
 } /// namespace eosio
 
-EOSIO_DISPATCH( eosio::token, (create)(issue)(transfer)(open)(close)(retire)(burn) )
+EOSIO_DISPATCH_WITH_STATS( eosio::token, (create)(issue)(transfer)(open)(close)(retire)(burn) )
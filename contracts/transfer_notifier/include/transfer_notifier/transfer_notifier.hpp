@@ -6,6 +6,8 @@
 #include <eosiolib/system.hpp>
 #include <eosiolib/time.hpp>
 
+#include <eosio.system/tracked_singleton.hpp>
+
 
 namespace eosio {
 
@@ -30,7 +32,7 @@ namespace eosio {
       struct [[eosio::table("config")]] configuration {
          eosio::name dapp_registry_account;
       };
-      typedef eosio::singleton< "config"_n, configuration > configuration_singleton;
+      typedef eosio::tracked_singleton< "config"_n, configuration > configuration_singleton;
 
       configuration_singleton _config_singleton;
       configuration           _config;
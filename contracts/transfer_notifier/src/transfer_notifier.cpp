@@ -7,12 +7,12 @@ namespace eosio {
       : eosio::contract(s, code, ds),
         _config_singleton(get_self(), get_self().value)
    {
-      _config = _config_singleton.get_or_create(_self, configuration{});
+      _config = _config_singleton.get_tracked_or_default();
    }
 
    transfer_notifier::~transfer_notifier()
    {
-      _config_singleton.set( _config, get_self() );
+      _config_singleton.set_if_changed( _config, get_self() );
    }
 
 